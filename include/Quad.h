@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cmath>
+
+#include "entities.h"
+
+/// Parallelogram spanned by two edges from a corner, e.g. a wall of a room. It is hit from both
+/// sides, and its normal is cross(edge1, edge2).
+struct Quad : public Entity {
+    explicit Quad(const glm::dvec3& corner,
+                  const glm::dvec3& edge1,
+                  const glm::dvec3& edge2,
+                  const Material& _material)
+        : Entity(_material, 0), edge1(edge1), edge2(edge2),
+          _normal(glm::normalize(glm::cross(edge1, edge2))) {
+        pos = corner;
+        // Dual axes of the edges in the plane: dot(_uAxis, edge1) = 1, dot(_uAxis, edge2) = 0
+        // and vice versa, so they give the coordinates of a point along edges of any angle.
+        glm::dvec3 n = glm::cross(edge1, edge2);
+        _uAxis = glm::cross(edge2, n) / glm::dot(n, n);
+        _vAxis = glm::cross(n, edge1) / glm::dot(n, n);
+    }
+
+    bool intersect(const Ray& ray, double& intersectionDistance) override {
+        Hit hit;
+        if (!intersect(ray, hit)) return false;
+        intersectionDistance = hit.distance;
+        return true;
+    }
+
+    bool intersect(const Ray& ray, Hit& hit) override {
+        // Rays that graze the plane are ignored.
+        double cosine = glm::dot(ray.dir, _normal);
+        if (std::fabs(cosine) <= 1e-3) return false;
+
+        double d = glm::dot(pos - ray.origin, _normal) / cosine;
+        if (d <= 0 || d >= hit.distance) return false;
+
+        glm::dvec3 p = ray.origin + ray.dir * d - pos;
+        double u = glm::dot(p, _uAxis);
+        double v = glm::dot(p, _vAxis);
+        // Edges are inclusive, so that rays do not slip through the seam of adjacent quads.
+        if (u < 0 || u > 1 || v < 0 || v > 1) return false;
+
+        hit.entity = this;
+        hit.distance = d;
+        hit.primitive = 0;
+        hit.uv = {u, v};
+        return true;
+    }
+
+    glm::dvec3 normal(const glm::dvec3& point, const Hit& hit) const override { return _normal; }
+
+    /// The texture coordinates of the material are the distances from the corner along the edges.
+    Material materialAt(const glm::dvec3& point, const Hit& hit) const override {
+        Material m = *material;
+        m.color = material->colorAt(hit.uv * glm::dvec2(glm::length(edge1), glm::length(edge2)));
+        return m;
+    }
+
+    BoundingBox boundingBox() const override {
+        BoundingBox bbox;
+        bbox.grow(pos);
+        bbox.grow(pos + edge1);
+        bbox.grow(pos + edge2);
+        bbox.grow(pos + edge1 + edge2);
+        return bbox;
+    }
+
+    double area() const override { return glm::length(glm::cross(edge1, edge2)); }
+
+    /// Samples a point on the quad uniformly by area.
+    bool sampleDirection(const glm::dvec3& point,
+                         const glm::dvec2& u,
+                         glm::dvec3& direction,
+                         double& pdf) const override {
+        glm::dvec3 d = pos + u.x * edge1 + u.y * edge2 - point;
+        double distance2 = glm::dot(d, d);
+        direction = d / std::sqrt(distance2);
+        double cosine = std::fabs(glm::dot(direction, _normal));
+        if (cosine <= 1e-6) return false;
+        pdf = distance2 / (cosine * area());
+        return true;
+    }
+
+    double directionPdf(const glm::dvec3& point, const glm::dvec3& lightPoint) const override {
+        glm::dvec3 d = lightPoint - point;
+        double distance2 = glm::dot(d, d);
+        double cosine = std::fabs(glm::dot(d, _normal)) / std::sqrt(distance2);
+        return cosine > 1e-6 ? distance2 / (cosine * area()) : 0;
+    }
+
+    bool samplePoint(const glm::dvec2& u, glm::dvec3& point, glm::dvec3& normal) const override {
+        point = pos + u.x * edge1 + u.y * edge2;
+        normal = _normal;
+        return true;
+    }
+
+    glm::dvec3 edge1;
+    glm::dvec3 edge2;
+
+  private:
+    glm::dvec3 _normal;
+    glm::dvec3 _uAxis;
+    glm::dvec3 _vAxis;
+};
@@ -1,8 +1,12 @@
+#include <algorithm>
+
+#include <glm/gtc/constants.hpp>
+
 #include "entities.h"
 
 struct Sphere : public Entity {
 
-    explicit Sphere(const glm::dvec3 _position, const float _radius, const Material _material): Entity(_material, _radius) {
+    explicit Sphere(const glm::dvec3 _position, const float _radius, const Material& _material): Entity(_material, _radius) {
         pos = _position;
     }
 
@@ -22,5 +26,70 @@ struct Sphere : public Entity {
         return true;
     }
 
-    // BoundingBox boundingBox() const = 0;   
+    void intersect(RayPacket& packet) override {
+        // Same arithmetic as the single ray test, without branches so that it vectorizes.
+        glm::dvec3 L = pos - packet.origin;
+        double L2 = glm::dot(L, L);
+        double r2 = pow(radius, 2);
+        double t[RayPacket::kMaxSize];
+        for (int i = 0; i < packet.size; ++i) {
+            double tca = L.x * packet.dir[0][i] + L.y * packet.dir[1][i] + L.z * packet.dir[2][i];
+            double d2 = L2 - tca * tca;
+            double thc = sqrtf(std::max(0.0, r2 - d2));
+            double t0 = tca - thc < 0 ? tca + thc : tca - thc;
+            t[i] = d2 > r2 || t0 < 0 ? INFINITY : t0;
+        }
+        for (int i = 0; i < packet.size; ++i) {
+            if (t[i] < packet.hits[i].distance) {
+                packet.hits[i].distance = t[i];
+                packet.hits[i].entity = this;
+            }
+        }
+    }
+
+    BoundingBox boundingBox() const override {
+        return BoundingBox(pos - glm::dvec3(radius), pos + glm::dvec3(radius));
+    }
+
+    double area() const override { return 4 * glm::pi<double>() * radius * radius; }
+
+    /// Samples the cone of directions under which the sphere is seen uniformly.
+    bool sampleDirection(const glm::dvec3& point,
+                         const glm::dvec2& u,
+                         glm::dvec3& direction,
+                         double& pdf) const override {
+        glm::dvec3 sw = pos - point;
+        double distance2 = glm::dot(sw, sw);
+        double radius2 = double(radius) * radius;
+        if (distance2 <= radius2) return false;
+        sw /= std::sqrt(distance2);
+        glm::dvec3 su = glm::normalize(
+            glm::cross(std::fabs(sw.x) > 0.1 ? glm::dvec3(0, 1, 0) : glm::dvec3(1, 0, 0), sw));
+        glm::dvec3 sv = glm::cross(sw, su);
+
+        double cosMax = std::sqrt(1 - radius2 / distance2);
+        double cosA = 1 - u.x + u.x * cosMax;
+        double sinA = std::sqrt(1 - cosA * cosA);
+        double phi = 2 * glm::pi<double>() * u.y;
+        direction = su * std::cos(phi) * sinA + sv * std::sin(phi) * sinA + sw * cosA;
+        pdf = 1 / (2 * glm::pi<double>() * (1 - cosMax));
+        return true;
+    }
+
+    double directionPdf(const glm::dvec3& point, const glm::dvec3& lightPoint) const override {
+        glm::dvec3 sw = pos - point;
+        double distance2 = glm::dot(sw, sw);
+        double radius2 = double(radius) * radius;
+        if (distance2 <= radius2) return 0;
+        return 1 / (2 * glm::pi<double>() * (1 - std::sqrt(1 - radius2 / distance2)));
+    }
+
+    bool samplePoint(const glm::dvec2& u, glm::dvec3& point, glm::dvec3& normal) const override {
+        double z = 1 - 2 * u.x;
+        double r = std::sqrt(std::max(0.0, 1 - z * z));
+        double phi = 2 * glm::pi<double>() * u.y;
+        normal = glm::dvec3(r * std::cos(phi), r * std::sin(phi), z);
+        point = pos + normal * double(radius);
+        return true;
+    }
 };
\ No newline at end of file
@@ -38,6 +38,46 @@ struct Triangle : public Entity {
         return (intersectionDistance > EPS) ? true : false;
     }
 
+    void intersect(RayPacket& packet) override {
+        // Same arithmetic as the single ray test, without branches so that it vectorizes. The
+        // rays share their origin, so everything that only depends on it is computed once.
+        double EPS = 0.0000001;
+
+        glm::dvec3 ab = v2 - v1;
+        glm::dvec3 ac = v3 - v1;
+        glm::dvec3 tvec = packet.origin - v1;
+        glm::dvec3 qvec = glm::cross(tvec, ab);
+        double dist = glm::dot(ac, qvec);
+
+        double t[RayPacket::kMaxSize];
+        for (int i = 0; i < packet.size; ++i) {
+            double dx = packet.dir[0][i], dy = packet.dir[1][i], dz = packet.dir[2][i];
+            glm::dvec3 n(dy * ac.z - ac.y * dz, dz * ac.x - ac.z * dx, dx * ac.y - ac.x * dy);
+            double det = ab.x * n.x + ab.y * n.y + ab.z * n.z;
+            double invDet = 1 / det;
+            double u = (tvec.x * n.x + tvec.y * n.y + tvec.z * n.z) * invDet;
+            double v = (dx * qvec.x + dy * qvec.y + dz * qvec.z) * invDet;
+            double d = dist * invDet;
+            bool hit = det >= EPS && u >= 0 && u <= 1 && v >= 0 && u + v <= 1 && d > EPS;
+            t[i] = hit ? d : INFINITY;
+        }
+        for (int i = 0; i < packet.size; ++i) {
+            if (t[i] < packet.hits[i].distance) {
+                packet.hits[i].distance = t[i];
+                packet.hits[i].entity = this;
+            }
+        }
+    }
+
+    BoundingBox boundingBox() const override {
+        return BoundingBox(glm::min(v1, glm::min(v2, v3)), glm::max(v1, glm::max(v2, v3)));
+    }
+
+    /// Face normal, on the side from which intersect() accepts hits.
+    glm::dvec3 normal(const glm::dvec3& point, const Hit& hit) const override {
+        return glm::normalize(glm::cross(v2 - v1, v3 - v1));
+    }
+
     glm::dvec3 v1;
     glm::dvec3 v2;
     glm::dvec3 v3;
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <thread>
+
+#include "bvh.h"
 #include "entities.h"
 
 template <typename T>
@@ -122,7 +129,8 @@ class TriangleMesh : public Entity {
                  const std::unique_ptr<uint32_t[]>& vertsIndex,
                  const std::unique_ptr<Vec3f[]>& verts,
                  std::unique_ptr<Vec3f[]>& normals,
-                 std::unique_ptr<Vec2f[]>& st)
+                 std::unique_ptr<Vec2f[]>& st,
+                 unsigned threads = std::thread::hardware_concurrency())
         : numTris(0), Entity() {
         pos = {-8, -10, -6};
         uint32_t k = 0, maxVertIndex = 0;
@@ -151,38 +159,68 @@ class TriangleMesh : public Entity {
                 trisIndex[l] = vertsIndex[k];
                 trisIndex[l + 1] = vertsIndex[k + j + 1];
                 trisIndex[l + 2] = vertsIndex[k + j + 2];
-                N[l] = normals[k];
-                N[l + 1] = normals[k + j + 1];
-                N[l + 2] = normals[k + j + 2];
-                texCoordinates[l] = st[k];
-                texCoordinates[l + 1] = st[k + j + 1];
-                texCoordinates[l + 2] = st[k + j + 2];
+                // normals and texture coordinates are given per vertex
+                N[l] = normals[trisIndex[l]];
+                N[l + 1] = normals[trisIndex[l + 1]];
+                N[l + 2] = normals[trisIndex[l + 2]];
+                texCoordinates[l] = st[trisIndex[l]];
+                texCoordinates[l + 1] = st[trisIndex[l + 1]];
+                texCoordinates[l + 2] = st[trisIndex[l + 2]];
                 l += 3;
             }
             k += faceIndex[i];
         }
+
+        buildBVH(threads);
     }
     // Test if the ray interesests this triangle mesh
-    bool intersect(const Vec3f& orig, const Vec3f& dir, float& tNear, uint32_t& triIndex, Vec2f& uv) const {
-        uint32_t j = 0;
+    bool intersect(const Ray& ray, double& intersectionDistance) override {
+        Hit hit;
+        if (!intersect(ray, hit)) return false;
+        intersectionDistance = hit.distance;
+        return true;
+    }
+
+    // Find the closest triangle hit by the ray, visiting only the leaves of the mesh BVH the ray
+    // passes through
+    bool intersect(const Ray& ray, Hit& hit) override {
+        const Vec3f orig(ray.origin.x, ray.origin.y, ray.origin.z);
+        const Vec3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
         bool isect = false;
-        for (uint32_t i = 0; i < numTris; ++i) {
-            const Vec3f& v0 = P[trisIndex[j]];
-            const Vec3f& v1 = P[trisIndex[j + 1]];
-            const Vec3f& v2 = P[trisIndex[j + 2]];
-            float t = kInfinity, u, v;
-            if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t < tNear) {
-                tNear = t;
-                uv.x = u;
-                uv.y = v;
-                triIndex = i;
-                isect = true;
+        _bvh.traverse(ray, hit.distance, [&](uint32_t begin, uint32_t end, double& tMax) {
+            for (uint32_t i = begin; i < end; ++i) {
+                const Vec3f& v0 = P[trisIndex[i * 3]];
+                const Vec3f& v1 = P[trisIndex[i * 3 + 1]];
+                const Vec3f& v2 = P[trisIndex[i * 3 + 2]];
+                float t = kInfinity, u, v;
+                if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t > 1e-4 &&
+                    t < hit.distance) {
+                    hit.distance = t;
+                    hit.entity = this;
+                    hit.primitive = i;
+                    hit.uv = {u, v};
+                    isect = true;
+                }
             }
-            j += 3;
-        }
+            tMax = hit.distance;
+            return true;
+        });
 
         return isect;
     }
+
+    // Interpolate the vertex normals of the triangle that was hit
+    glm::dvec3 normal(const glm::dvec3& point, const Hit& hit) const override {
+        const Vec3f& n0 = N[hit.primitive * 3];
+        const Vec3f& n1 = N[hit.primitive * 3 + 1];
+        const Vec3f& n2 = N[hit.primitive * 3 + 2];
+        float w = float(1 - hit.uv.x - hit.uv.y);
+        Vec3f n = n0 * w + n1 * float(hit.uv.x) + n2 * float(hit.uv.y);
+        return glm::normalize(glm::dvec3(n.x, n.y, n.z));
+    }
+
+    BoundingBox boundingBox() const override { return _bvh.bounds(); }
+
     void getSurfaceProperties(const Vec3f& hitPoint, const Vec3f& viewDirection, const uint32_t& triIndex, const Vec2f& uv, Vec3f& hitNormal, Vec2f& hitTextureCoordinates) const {
         // face normal
         const Vec3f& v0 = P[trisIndex[triIndex * 3]];
@@ -203,9 +241,42 @@ class TriangleMesh : public Entity {
     std::unique_ptr<uint32_t[]> trisIndex;   // vertex index array
     std::unique_ptr<Vec3f[]> N;              // triangles vertex normals
     std::unique_ptr<Vec2f[]> texCoordinates; // triangles texture coordinates
+
+  private:
+    // Build the bottom-level BVH over the triangles on up to `threads` threads and store them in
+    // its leaf order
+    void buildBVH(unsigned threads) {
+        std::vector<BoundingBox> bounds(numTris);
+        BVHTree::parallelFor(numTris, threads, [&](size_t i) {
+            for (uint32_t j = 0; j < 3; ++j) {
+                const Vec3f& p = P[trisIndex[i * 3 + j]];
+                bounds[i].grow(glm::dvec3(p.x, p.y, p.z));
+            }
+        });
+        _bvh = BVHTree(bounds, threads);
+
+        std::unique_ptr<uint32_t[]> sortedIndex(new uint32_t[numTris * 3]);
+        std::unique_ptr<Vec3f[]> sortedN(new Vec3f[numTris * 3]);
+        std::unique_ptr<Vec2f[]> sortedTexCoordinates(new Vec2f[numTris * 3]);
+        for (uint32_t i = 0; i < numTris; ++i) {
+            uint32_t src = _bvh.order()[i];
+            for (uint32_t j = 0; j < 3; ++j) {
+                sortedIndex[i * 3 + j] = trisIndex[src * 3 + j];
+                sortedN[i * 3 + j] = N[src * 3 + j];
+                sortedTexCoordinates[i * 3 + j] = texCoordinates[src * 3 + j];
+            }
+        }
+        trisIndex = std::move(sortedIndex);
+        N = std::move(sortedN);
+        texCoordinates = std::move(sortedTexCoordinates);
+    }
+
+    BVHTree _bvh; // bottom-level BVH, triangles are stored in its leaf order
 };
 
-TriangleMesh* generatePolyShphere(float rad, uint32_t divs) {
+TriangleMesh* generatePolyShphere(float rad,
+                                  uint32_t divs,
+                                  unsigned threads = std::thread::hardware_concurrency()) {
     // generate points
     float mpi = 3.14159265358979323846;
     float mpi_2 = 1.57079632679489661923;
@@ -270,5 +341,5 @@ TriangleMesh* generatePolyShphere(float rad, uint32_t divs) {
         vid = numV;
     }
 
-    return new TriangleMesh(npolys, faceIndex, vertsIndex, P, N, st);
+    return new TriangleMesh(npolys, faceIndex, vertsIndex, P, N, st, threads);
 }
\ No newline at end of file
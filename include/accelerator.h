@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+
+#include "entities.h"
+#include "packet.h"
+#include "ray.h"
+
+/// Interface of the spatial data structures the ray tracer uses to find intersections.
+class Accelerator {
+  public:
+    virtual ~Accelerator() = default;
+
+    /// All entities stored in the accelerator.
+    virtual const std::vector<Entity*>& entities() const = 0;
+
+    /// Finds the entity closest to the ray origin that is hit by the ray before `hit.distance` and
+    /// stores it in `hit`. Entities for which `skip` returns true are ignored. Queries never
+    /// allocate, so they can be used for every ray.
+    virtual bool intersect(const Ray& ray,
+                           Hit& hit,
+                           bool (*skip)(const Entity*) = nullptr) const = 0;
+
+    /// Finds the closest hit of every ray of a packet, like intersect() does for a single ray. By
+    /// default the rays are traced one by one.
+    virtual void intersect(RayPacket& packet, bool (*skip)(const Entity*) = nullptr) const {
+        for (int i = 0; i < packet.size; ++i) intersect(packet.rays[i], packet.hits[i], skip);
+    }
+
+    /// Checks if any entity is hit by the ray before `tMax`. Returns on the first hit found, which
+    /// is not necessarily the closest one, so it is cheaper than intersect() for shadow rays.
+    virtual bool occluded(const Ray& ray,
+                          double tMax,
+                          bool (*skip)(const Entity*) = nullptr) const = 0;
+};
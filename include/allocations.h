@@ -0,0 +1,26 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/// Number of heap allocations made through the global operator new. Counting is only compiled in
+/// with GI_COUNT_ALLOCATIONS (CMake option COUNT_ALLOCATIONS); otherwise this always returns 0.
+inline std::atomic<size_t>& allocationCounter() {
+    static std::atomic<size_t> counter{0};
+    return counter;
+}
+
+inline size_t allocationCount() { return allocationCounter().load(std::memory_order_relaxed); }
+
+#ifdef GI_COUNT_ALLOCATIONS
+// The array forms fall back to these, so they cover every allocation of the program.
+void* operator new(std::size_t size) {
+    allocationCounter().fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#endif
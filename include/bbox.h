@@ -1,34 +1,173 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
 
 #include <glm/glm.hpp>
+#if GLM_ARCH & GLM_ARCH_SSE2_BIT
+#include <glm/simd/common.h>
+#endif
+
+#include "ray.h"
 
 /// Represents an axis-aligned bounding box.
 struct BoundingBox {
+    /// Creates an empty bounding box that can be grown.
+    BoundingBox() : min(INFINITY), max(-INFINITY) {}
     BoundingBox(glm::dvec3 min, glm::dvec3 max) : min(min), max(max) {
-        assert(min.x < max.x);
-        assert(min.y < max.y);
-        assert(min.z < max.z);
+        // Flat boxes are allowed, e.g. for axis-aligned triangles.
+        assert(min.x <= max.x);
+        assert(min.y <= max.y);
+        assert(min.z <= max.z);
     }
 
     double dx() const { return max.x - min.x; }
     double dy() const { return max.y - min.y; }
     double dz() const { return max.z - min.z; }
 
-    const glm::dvec3 min;
-    const glm::dvec3 max;
+    glm::dvec3 center() const { return (min + max) * 0.5; }
+
+    double surfaceArea() const {
+        if (min.x > max.x) return 0;
+        return 2 * (dx() * dy() + dy() * dz() + dz() * dx());
+    }
+
+    /// Enlarges the bounding box to contain the point.
+    void grow(glm::dvec3 point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    /// Enlarges the bounding box to contain another bounding box.
+    void grow(const BoundingBox& other) {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+
+    glm::dvec3 min;
+    glm::dvec3 max;
 
     /// Check if another bounding box intersects the current bounding box.
     bool intersect(const BoundingBox& other) const {
-        // TODO Implement this
-        return false;
+        return min.x <= other.max.x && other.min.x <= max.x && min.y <= other.max.y &&
+               other.min.y <= max.y && min.z <= other.max.z && other.min.z <= max.z;
     }
 
     /// Check if a point lies within the bounding box.
     bool contains(glm::dvec3 point) const {
-        // TODO Implement this
-        return false;
+        return point.x >= min.x && point.x <= max.x && point.y >= min.y && point.y <= max.y &&
+               point.z >= min.z && point.z <= max.z;
+    }
+
+    /// Check if another bounding box lies completely within the bounding box.
+    bool contains(const BoundingBox& other) const {
+        return contains(other.min) && contains(other.max);
+    }
+
+    /// Check if a ray intersects the bounding box. On success [tNear, tFar] is the parametric
+    /// interval of the ray inside the box; tNear is clamped to 0 for rays starting inside.
+    bool intersect(const Ray& ray, double& tNear, double& tFar) const {
+        // Branch-free slab test: the sign bits pick the near and far planes per axis. NaNs from
+        // rays that start on the slab of an axis they are parallel to are always passed as the
+        // second argument of std::max/std::min, which then keep the interval of the other axes.
+        double tx0 = ((ray.sign[0] ? max.x : min.x) - ray.origin.x) * ray.invDir.x;
+        double tx1 = ((ray.sign[0] ? min.x : max.x) - ray.origin.x) * ray.invDir.x;
+        double ty0 = ((ray.sign[1] ? max.y : min.y) - ray.origin.y) * ray.invDir.y;
+        double ty1 = ((ray.sign[1] ? min.y : max.y) - ray.origin.y) * ray.invDir.y;
+        double tz0 = ((ray.sign[2] ? max.z : min.z) - ray.origin.z) * ray.invDir.z;
+        double tz1 = ((ray.sign[2] ? min.z : max.z) - ray.origin.z) * ray.invDir.z;
+        tNear = std::max(std::max(std::max(0.0, tx0), ty0), tz0);
+        tFar = std::min(std::min(std::min(double(INFINITY), tx1), ty1), tz1);
+        return tNear <= tFar;
     }
 };
+
+/// Ray prepared for BoundingBox4 tests: origin and inverse direction in single precision,
+/// broadcast to all lanes.
+struct PackedRay {
+    PackedRay() = default;
+    explicit PackedRay(const Ray& ray) {
+        for (int i = 0; i < 3; ++i) {
+#if GLM_ARCH & GLM_ARCH_SSE2_BIT
+            origin[i] = _mm_set1_ps(static_cast<float>(ray.origin[i]));
+            invDir[i] = _mm_set1_ps(static_cast<float>(ray.invDir[i]));
+#else
+            origin[i] = static_cast<float>(ray.origin[i]);
+            invDir[i] = static_cast<float>(ray.invDir[i]);
+#endif
+            sign[i] = ray.sign[i];
+        }
+    }
+
+#if GLM_ARCH & GLM_ARCH_SSE2_BIT
+    glm_vec4 origin[3];
+    glm_vec4 invDir[3];
+#else
+    float origin[3];
+    float invDir[3];
+#endif
+    int sign[3];
+};
+
+/// Four axis-aligned bounding boxes in structure-of-arrays layout, so that one ray is tested
+/// against all of them with a single vector slab test. Unused lanes hold empty boxes.
+struct alignas(16) BoundingBox4 {
+    BoundingBox4() {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int lane = 0; lane < 4; ++lane) {
+                bounds[0][axis][lane] = INFINITY;
+                bounds[1][axis][lane] = -INFINITY;
+            }
+        }
+    }
+
+    /// Stores a box in a lane. Bounds are rounded outwards to single precision, with some slack
+    /// for the rounding of the ray, so that the test never misses a box the exact test hits.
+    void set(int lane, const BoundingBox& bbox) {
+        for (int axis = 0; axis < 3; ++axis) {
+            double slack = 1e-5 * (std::fabs(bbox.min[axis]) + std::fabs(bbox.max[axis]) + 1);
+            bounds[0][axis][lane] = static_cast<float>(bbox.min[axis] - slack);
+            bounds[1][axis][lane] = static_cast<float>(bbox.max[axis] + slack);
+        }
+    }
+
+    /// Returns a bit mask of the lanes whose box is hit by the ray before tMax, and writes the
+    /// entry distances of all lanes to tNear.
+    int intersect(const PackedRay& ray, float tMax, float tNear[4]) const {
+#if GLM_ARCH & GLM_ARCH_SSE2_BIT
+        // _mm_max_ps/_mm_min_ps return their second operand if either one is NaN, so the running
+        // interval is always passed second.
+        glm_vec4 t0 = _mm_setzero_ps();
+        glm_vec4 t1 = _mm_set1_ps(tMax);
+        for (int axis = 0; axis < 3; ++axis) {
+            int s = ray.sign[axis];
+            glm_vec4 nearPlane = glm_vec4_sub(_mm_load_ps(bounds[s][axis]), ray.origin[axis]);
+            glm_vec4 farPlane = glm_vec4_sub(_mm_load_ps(bounds[1 - s][axis]), ray.origin[axis]);
+            t0 = _mm_max_ps(glm_vec4_mul(nearPlane, ray.invDir[axis]), t0);
+            t1 = _mm_min_ps(glm_vec4_mul(farPlane, ray.invDir[axis]), t1);
+        }
+        _mm_storeu_ps(tNear, t0);
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+        int mask = 0;
+        for (int lane = 0; lane < 4; ++lane) {
+            float t0 = 0, t1 = tMax;
+            for (int axis = 0; axis < 3; ++axis) {
+                int s = ray.sign[axis];
+                float a = (bounds[s][axis][lane] - ray.origin[axis]) * ray.invDir[axis];
+                float b = (bounds[1 - s][axis][lane] - ray.origin[axis]) * ray.invDir[axis];
+                t0 = a > t0 ? a : t0;
+                t1 = b < t1 ? b : t1;
+            }
+            tNear[lane] = t0;
+            mask |= (t0 <= t1) << lane;
+        }
+        return mask;
+#endif
+    }
+
+    /// bounds[0] holds the minimum and bounds[1] the maximum corner, per axis and lane.
+    float bounds[2][3][4];
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "entities.h"
+#include "material.h"
+
+/// Vertex of a camera or light subpath of the bidirectional path tracer [Veach 1997]. Densities
+/// are per unit area at the vertex, so that the densities with which both subpaths generate a
+/// vertex can be compared for multiple importance sampling.
+struct PathVertex {
+    enum class Type {
+        Camera,  ///< Pinhole of the camera, first vertex of camera subpaths.
+        Light,   ///< Point on an emitter, first vertex of light subpaths.
+        Surface, ///< Any other scattering point.
+    };
+
+    static PathVertex camera(const glm::dvec3& point, const glm::dvec3& forward) {
+        PathVertex v;
+        v.type = Type::Camera;
+        v.point = point;
+        v.normal = forward;
+        v.throughput = glm::dvec3(1);
+        return v;
+    }
+
+    static PathVertex light(const Entity* entity, const glm::dvec3& point,
+                            const glm::dvec3& normal, const glm::dvec3& throughput) {
+        PathVertex v;
+        v.type = Type::Light;
+        v.entity = entity;
+        v.point = point;
+        v.normal = normal;
+        v.throughput = throughput;
+        v.emission = entity->material->emission;
+        return v;
+    }
+
+    static PathVertex surface(const Entity* entity, const glm::dvec3& point,
+                              const glm::dvec3& normal, const Material& material,
+                              const glm::dvec3& throughput) {
+        PathVertex v;
+        v.type = Type::Surface;
+        v.entity = entity;
+        v.point = point;
+        v.normal = normal;
+        v.throughput = throughput;
+        v.color = material.color;
+        v.emission = material.emission;
+        v.materialType = material.materialType;
+        v.delta = material.materialType != MaterialType::Diffuse;
+        return v;
+    }
+
+    bool isEmissive() const { return emission != glm::dvec3(0); }
+
+    /// Diffuse reflection between the normalized directions `wi` and `wo` leaving the vertex.
+    /// Specular and dielectric surfaces scatter into single directions, so this is 0 for them.
+    glm::dvec3 f(const glm::dvec3& wi, const glm::dvec3& wo) const {
+        if (delta || glm::dot(wi, normal) * glm::dot(wo, normal) <= 0) return glm::dvec3(0);
+        return color / glm::pi<double>();
+    }
+
+    /// Solid angle density with which a diffuse vertex reached from `wi` samples `wo`.
+    double pdf(const glm::dvec3& wi, const glm::dvec3& wo) const {
+        if (delta || glm::dot(wi, normal) * glm::dot(wo, normal) <= 0) return 0;
+        return std::fabs(glm::dot(wo, normal)) / glm::pi<double>();
+    }
+
+    /// Converts the solid angle density of the direction from this vertex towards `next` into a
+    /// density per unit area at `next`.
+    double toArea(double pdf, const PathVertex& next) const {
+        glm::dvec3 d = next.point - point;
+        double distance2 = glm::dot(d, d);
+        if (next.type != Type::Camera) {
+            pdf *= std::fabs(glm::dot(next.normal, d)) / std::sqrt(distance2);
+        }
+        return pdf / distance2;
+    }
+
+    Type type = Type::Surface;
+    glm::dvec3 point = glm::dvec3(0);
+    /// Geometric normal, or the viewing direction of the camera.
+    glm::dvec3 normal = glm::dvec3(0);
+    /// Product of the scattering and emission terms of the subpath up to the vertex, divided by
+    /// the densities of the vertices.
+    glm::dvec3 throughput = glm::dvec3(0);
+    const Entity* entity = nullptr;
+    glm::dvec3 color = glm::dvec3(0);
+    glm::dvec3 emission = glm::dvec3(0);
+    MaterialType materialType = MaterialType::Diffuse;
+    /// Specular and dielectric vertices cannot be connected to other subpaths.
+    bool delta = false;
+    /// Density with which the subpath generated the vertex.
+    double pdfFwd = 0;
+    /// Density with which the other subpath would have generated it, coming from the next vertex.
+    double pdfRev = 0;
+};
+
+/// Sums the light tracing contributions that bidirectional path tracing splats onto arbitrary
+/// pixels. Values are summed in fixed point, so that the sums do not depend on the order in which
+/// threads add to them and images stay the same for any number of threads.
+class SplatBuffer {
+  public:
+    SplatBuffer(int width, int height)
+        : _width(width), _values(static_cast<size_t>(width) * height * 3) {}
+
+    /// Adds `value` to the pixel at `pixel`, which must lie inside the image.
+    void add(const glm::dvec2& pixel, const glm::dvec3& value) {
+        size_t i = (static_cast<size_t>(pixel.y) * _width + static_cast<size_t>(pixel.x)) * 3;
+        for (int c = 0; c < 3; ++c) {
+            // Extreme values from near-singular connections are clamped, NaNs are dropped.
+            double v = std::fmin(std::fmax(value[c], 0.0), kMaxValue);
+            if (v > 0) {
+                _values[i + c].fetch_add(std::llround(v * kScale), std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Resets all sums to 0.
+    void clear() {
+        for (auto& value : _values) value.store(0, std::memory_order_relaxed);
+    }
+
+    /// Sum of the values added to pixel (x, y).
+    glm::dvec3 get(int x, int y) const {
+        size_t i = (static_cast<size_t>(y) * _width + x) * 3;
+        return glm::dvec3(_values[i].load(std::memory_order_relaxed),
+                          _values[i + 1].load(std::memory_order_relaxed),
+                          _values[i + 2].load(std::memory_order_relaxed)) *
+               (1 / kScale);
+    }
+
+  private:
+    /// Fixed point scale; sums stay exact to 2^-24 and overflow beyond 2^39.
+    static constexpr double kScale = double(1 << 24);
+    /// Largest value added at once, so that sums over millions of paths do not overflow.
+    static constexpr double kMaxValue = 1e6;
+
+    int _width;
+    std::vector<std::atomic<int64_t>> _values;
+};
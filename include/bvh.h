@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "accelerator.h"
+#include "bbox.h"
+#include "entities.h"
+#include "packet.h"
+#include "scheduler.h"
+
+/// Binary bounding volume hierarchy over a set of primitives given by their bounding boxes. It is
+/// built top-down with the binned surface area heuristic (SAH), which keeps traversal cost
+/// predictable for scenes that mix a few large objects with many small ones. The owner of the
+/// primitives stores them in leaf order, see order().
+class BVHTree {
+  public:
+    /// Deepest level of the hierarchy; bounds the traversal stack.
+    static constexpr int kMaxDepth = 64;
+
+    BVHTree() = default;
+
+    /// Builds the hierarchy. Large subtrees are built concurrently on up to `threads` threads.
+    explicit BVHTree(const std::vector<BoundingBox>& bounds,
+                     unsigned threads = std::thread::hardware_concurrency()) {
+        if (bounds.empty()) return;
+
+        size_t n = bounds.size();
+        threads = std::max(threads, 1u);
+        std::vector<Primitive> primitives(n);
+        parallelFor(n, threads, [&](size_t i) {
+            primitives[i] = {bounds[i], bounds[i].center(), static_cast<uint32_t>(i)};
+        });
+
+        _nodes.resize(2 * n - 1);
+        Builder builder{primitives, {1}, {static_cast<int>(threads) - 1}};
+        build(builder, 0, 0, static_cast<uint32_t>(n), 0);
+        _nodes.resize(builder.nodeCount);
+
+        _order.reserve(n);
+        for (const Primitive& p : primitives) _order.push_back(p.index);
+    }
+
+    /// Calls `f(i)` for every index in [0, n) in batches on up to `threads` threads of the
+    /// TaskScheduler. Small ranges run on the calling thread.
+    template <typename Function>
+    static void parallelFor(size_t n, unsigned threads, Function f) {
+        if (n < kParallelThreshold || threads <= 1) {
+            for (size_t i = 0; i < n; ++i) f(i);
+            return;
+        }
+        size_t batches = (n + kParallelBatch - 1) / kParallelBatch;
+        TaskScheduler::run(batches, threads, [&](size_t batch, unsigned) {
+            size_t end = std::min(n, (batch + 1) * kParallelBatch);
+            for (size_t i = batch * kParallelBatch; i < end; ++i) f(i);
+        });
+    }
+
+    /// Index of the primitive at every leaf position. Leaves refer to ranges of leaf positions.
+    const std::vector<uint32_t>& order() const { return _order; }
+
+    struct Node {
+        BoundingBox bbox;
+        uint32_t first = 0; // first leaf position for leaves, left child for inner nodes (right +1)
+        uint32_t count = 0; // number of primitives, 0 for inner nodes
+
+        bool is_leaf() const { return count > 0; }
+    };
+
+    /// Nodes of the hierarchy, the root comes first.
+    const std::vector<Node>& nodes() const { return _nodes; }
+
+    BoundingBox bounds() const { return _nodes.empty() ? BoundingBox() : _nodes[0].bbox; }
+
+    /// Visits the leaves whose bounds are hit by the ray, nearest child first. `visit(begin, end,
+    /// tMax)` receives the range of leaf positions of a leaf. It may lower tMax, and stops the
+    /// traversal by returning false; nodes beyond tMax are skipped.
+    template <typename Visitor>
+    void traverse(const Ray& ray, double tMax, Visitor visit) const {
+        double tNear, tFar;
+        if (_nodes.empty() || !_nodes[0].bbox.intersect(ray, tNear, tFar) || tNear > tMax) return;
+
+        struct Entry {
+            uint32_t node;
+            double tNear;
+        };
+        // Every inner node replaces itself with at most two children.
+        std::array<Entry, kMaxDepth + 1> stack;
+        int size = 0;
+        stack[size++] = {0, tNear};
+
+        while (size > 0) {
+            Entry entry = stack[--size];
+            if (entry.tNear > tMax) continue;
+
+            const Node& node = _nodes[entry.node];
+            if (node.is_leaf()) {
+                if (!visit(node.first, node.first + node.count, tMax)) return;
+                continue;
+            }
+
+            double tLeft, tRight;
+            bool hitLeft = _nodes[node.first].bbox.intersect(ray, tLeft, tFar) && tLeft <= tMax;
+            bool hitRight =
+                _nodes[node.first + 1].bbox.intersect(ray, tRight, tFar) && tRight <= tMax;
+            // Push the farther child first so that the nearer one is visited next.
+            if (hitLeft && hitRight && tLeft <= tRight) {
+                stack[size++] = {node.first + 1, tRight};
+                stack[size++] = {node.first, tLeft};
+            } else if (hitLeft && hitRight) {
+                stack[size++] = {node.first, tLeft};
+                stack[size++] = {node.first + 1, tRight};
+            } else if (hitLeft) {
+                stack[size++] = {node.first, tLeft};
+            } else if (hitRight) {
+                stack[size++] = {node.first + 1, tRight};
+            }
+        }
+    }
+
+    /// Visits the leaves that any ray of the packet may hit before its current closest hit,
+    /// nearest child first. `visit(begin, end)` receives the range of leaf positions of a leaf.
+    template <typename Visitor>
+    void traverse(const RayPacket& packet, Visitor visit) const {
+        if (_nodes.empty()) return;
+
+        std::array<uint32_t, kMaxDepth + 1> stack;
+        int size = 0;
+        stack[size++] = 0;
+
+        while (size > 0) {
+            const Node& node = _nodes[stack[--size]];
+            if (!packet.mayHit(node.bbox)) continue;
+
+            if (node.is_leaf()) {
+                visit(node.first, node.first + node.count);
+                continue;
+            }
+
+            // Order the children along the mean direction of the packet.
+            const glm::dvec3 toRight =
+                _nodes[node.first + 1].bbox.center() - _nodes[node.first].bbox.center();
+            bool leftFirst = glm::dot(toRight, packet.frustum.axis) >= 0;
+            stack[size++] = leftFirst ? node.first + 1 : node.first;
+            stack[size++] = leftFirst ? node.first : node.first + 1;
+        }
+    }
+
+  private:
+    static constexpr int kBins = 16;
+    /// Cost of visiting an inner node relative to one primitive intersection.
+    static constexpr double kTraversalCost = 1.0;
+    /// Leaves are forced to split above this size even if the SAH prefers a leaf.
+    static constexpr uint32_t kMaxLeafSize = 8;
+    /// Subtrees and loops with fewer primitives always run on the current thread.
+    static constexpr uint32_t kParallelThreshold = 4096;
+    /// Indices that one task of parallelFor() visits.
+    static constexpr size_t kParallelBatch = 1024;
+
+    struct Primitive {
+        BoundingBox bbox;
+        glm::dvec3 centroid;
+        uint32_t index;
+    };
+
+    struct Bin {
+        BoundingBox bbox;
+        uint32_t count = 0;
+    };
+
+    /// State shared by all threads of one build.
+    struct Builder {
+        std::vector<Primitive>& primitives;
+        std::atomic<uint32_t> nodeCount;
+        std::atomic<int> freeThreads;
+    };
+
+
+    void build(Builder& builder, uint32_t nodeIndex, uint32_t begin, uint32_t end, int depth) {
+        std::vector<Primitive>& primitives = builder.primitives;
+        Node& node = _nodes[nodeIndex];
+        BoundingBox centroids;
+        for (uint32_t i = begin; i < end; ++i) {
+            node.bbox.grow(primitives[i].bbox);
+            centroids.grow(primitives[i].centroid);
+        }
+
+        uint32_t count = end - begin;
+        node.first = begin;
+        node.count = count;
+        if (count == 1 || depth >= kMaxDepth - 1) return;
+
+        // Find the cheapest binned split over all three axes.
+        int bestAxis = -1, bestBin = 0;
+        double bestCost = INFINITY;
+        for (int axis = 0; axis < 3; ++axis) {
+            double extent = centroids.max[axis] - centroids.min[axis];
+            if (extent <= 0) continue;
+            double scale = kBins / extent;
+
+            std::array<Bin, kBins> bins;
+            for (uint32_t i = begin; i < end; ++i) {
+                int b = binIndex(primitives[i].centroid[axis], centroids.min[axis], scale);
+                bins[b].count++;
+                bins[b].bbox.grow(primitives[i].bbox);
+            }
+
+            // Sweep from the right to collect the cost of every right-hand side.
+            std::array<double, kBins - 1> rightCost;
+            BoundingBox right;
+            uint32_t rightCount = 0;
+            for (int b = kBins - 1; b > 0; --b) {
+                right.grow(bins[b].bbox);
+                rightCount += bins[b].count;
+                rightCost[b - 1] = rightCount * right.surfaceArea();
+            }
+
+            BoundingBox left;
+            uint32_t leftCount = 0;
+            for (int b = 0; b < kBins - 1; ++b) {
+                left.grow(bins[b].bbox);
+                leftCount += bins[b].count;
+                double cost = leftCount * left.surfaceArea() + rightCost[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        // All centroids coincide: nothing left to split.
+        if (bestAxis < 0) return;
+
+        bestCost = kTraversalCost + bestCost / node.bbox.surfaceArea();
+        if (bestCost >= count && count <= kMaxLeafSize) return;
+
+        double extent = centroids.max[bestAxis] - centroids.min[bestAxis];
+        double scale = kBins / extent;
+        double min = centroids.min[bestAxis];
+        Primitive* middle = std::partition(
+            primitives.data() + begin, primitives.data() + end, [&](const Primitive& p) {
+                return binIndex(p.centroid[bestAxis], min, scale) <= bestBin;
+            });
+        uint32_t mid = static_cast<uint32_t>(middle - primitives.data());
+        if (mid == begin || mid == end) {
+            mid = begin + count / 2;
+            std::nth_element(primitives.data() + begin, primitives.data() + mid,
+                             primitives.data() + end, [&](const Primitive& a, const Primitive& b) {
+                                 return a.centroid[bestAxis] < b.centroid[bestAxis];
+                             });
+        }
+
+        uint32_t leftChild = builder.nodeCount.fetch_add(2);
+        node.first = leftChild;
+        node.count = 0;
+
+        if (count >= kParallelThreshold && acquireThread(builder)) {
+            std::thread worker([&, leftChild, begin, mid, depth]() {
+                build(builder, leftChild, begin, mid, depth + 1);
+            });
+            build(builder, leftChild + 1, mid, end, depth + 1);
+            worker.join();
+            builder.freeThreads++;
+        } else {
+            build(builder, leftChild, begin, mid, depth + 1);
+            build(builder, leftChild + 1, mid, end, depth + 1);
+        }
+    }
+
+    static int binIndex(double centroid, double min, double scale) {
+        return std::min(kBins - 1, static_cast<int>((centroid - min) * scale));
+    }
+
+    static bool acquireThread(Builder& builder) {
+        int free = builder.freeThreads.load();
+        while (free > 0) {
+            if (builder.freeThreads.compare_exchange_weak(free, free - 1)) return true;
+        }
+        return false;
+    }
+
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _order;
+};
+
+/// Scene accelerator that stores the entities in a bounding volume hierarchy over their bounding
+/// boxes. `Tree` is BVHTree or any tree with the same construction and traversal interface.
+template <typename Tree>
+class BVHAccelerator : public Accelerator {
+  public:
+    explicit BVHAccelerator(std::vector<Entity*> entities,
+                            unsigned threads = std::thread::hardware_concurrency())
+        : _entities(std::move(entities)) {
+        std::vector<BoundingBox> bounds(_entities.size());
+        BVHTree::parallelFor(bounds.size(), std::max(threads, 1u),
+                             [&](size_t i) { bounds[i] = _entities[i]->boundingBox(); });
+        _tree = Tree(bounds, threads);
+
+        _ordered.reserve(_entities.size());
+        for (uint32_t i : _tree.order()) _ordered.push_back(_entities[i]);
+    }
+
+    const std::vector<Entity*>& entities() const override { return _entities; }
+
+    bool intersect(const Ray& ray,
+                   Hit& hit,
+                   bool (*skip)(const Entity*) = nullptr) const override {
+        bool found = false;
+        _tree.traverse(ray, hit.distance, [&](uint32_t begin, uint32_t end, double& tMax) {
+            for (uint32_t i = begin; i < end; ++i) {
+                Entity* e = _ordered[i];
+                if ((!skip || !skip(e)) && e->intersect(ray, hit)) found = true;
+            }
+            tMax = hit.distance;
+            return true;
+        });
+        return found;
+    }
+
+    void intersect(RayPacket& packet, bool (*skip)(const Entity*) = nullptr) const override {
+        _tree.traverse(packet, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                Entity* e = _ordered[i];
+                if (!skip || !skip(e)) e->intersect(packet);
+            }
+        });
+    }
+
+    bool occluded(const Ray& ray,
+                  double tMax,
+                  bool (*skip)(const Entity*) = nullptr) const override {
+        bool found = false;
+        _tree.traverse(ray, tMax, [&](uint32_t begin, uint32_t end, double&) {
+            for (uint32_t i = begin; i < end; ++i) {
+                Entity* e = _ordered[i];
+                double dist_i;
+                if ((!skip || !skip(e)) && e->intersect(ray, dist_i) && dist_i < tMax) {
+                    found = true;
+                    return false;
+                }
+            }
+            return true;
+        });
+        return found;
+    }
+
+  private:
+    std::vector<Entity*> _entities;
+    std::vector<Entity*> _ordered; // entities in leaf order
+    Tree _tree;
+};
+
+using BVH = BVHAccelerator<BVHTree>;
@@ -14,3 +14,58 @@ struct Camera {
     const double sensorDiag = 0.035; // diagonal of the sensor
     const double focalDist = 0.04;   // focal distance
 };
+
+/// Pinhole projection of a camera onto an image of `width` x `height` pixels. The image plane lies
+/// at distance 1 in front of the camera and pixel (x, y) covers [x, x + 1) x [y, y + 1) of it.
+struct ImagePlane {
+    ImagePlane(const Camera& camera, int width, int height, double halfHeight)
+        : position(camera.pos), forward(camera.forward),
+          right(glm::normalize(glm::cross(camera.forward, camera.up))),
+          up(glm::cross(right, forward)), width(width), height(height), halfHeight(halfHeight),
+          halfWidth(halfHeight * ((double)width / height)) {}
+
+    /// Direction through a point of the image, not normalized.
+    glm::dvec3 direction(double x, double y) const {
+        glm::dvec2 screenCoord((2.0 * x) / (double)width - 1.0f, (-2.0 * y) / (double)height + 1.0);
+        return forward + screenCoord.x * halfWidth * right + screenCoord.y * halfHeight * up;
+    }
+
+    /// Finds the image position at which `point` is seen. Returns false if it is outside.
+    bool project(const glm::dvec3& point, glm::dvec2& pixel) const {
+        glm::dvec3 d = point - position;
+        double depth = glm::dot(d, forward);
+        if (depth <= 0) return false;
+        d /= depth;
+        pixel.x = (glm::dot(d, right) / halfWidth + 1) * 0.5 * width;
+        pixel.y = (1 - glm::dot(d, up) / halfHeight) * 0.5 * height;
+        return pixel.x >= 0 && pixel.x < width && pixel.y >= 0 && pixel.y < height;
+    }
+
+    /// Area of the image on the plane.
+    double area() const { return 4 * halfWidth * halfHeight; }
+
+    /// Solid angle density of the normalized direction `dir` through a uniformly sampled point of
+    /// the image, 0 if it misses the image.
+    double directionPdf(const glm::dvec3& dir) const {
+        glm::dvec2 pixel;
+        if (!project(position + dir, pixel)) return 0;
+        double cosine = glm::dot(dir, forward);
+        return 1 / (area() * cosine * cosine * cosine);
+    }
+
+    /// Importance the camera emits along `dir`, normalized so that a path that reaches the camera
+    /// contributes its radiance to the image once per image sample.
+    double importance(const glm::dvec3& dir) const {
+        double cosine = glm::dot(dir, forward);
+        return directionPdf(dir) / cosine;
+    }
+
+    glm::dvec3 position;
+    glm::dvec3 forward;
+    glm::dvec3 right;
+    glm::dvec3 up;
+    int width;
+    int height;
+    double halfHeight;
+    double halfWidth;
+};
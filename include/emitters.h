@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "entities.h"
+#include "lighttree.h"
+
+/// Luminance of a linear RGB color.
+inline double luminance(const glm::dvec3& c) { return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b; }
+
+/// The emissive entities of a scene, i.e. the lights of the path tracer. Built once when the scene
+/// is set up, so direct lighting does not have to search the scene for lights. Lights are selected
+/// for a shading point with a LightTree, so that the lights close to it are picked more often than
+/// distant ones of the same power, and selection stays cheap for thousands of lights.
+class EmitterList {
+  public:
+    EmitterList() = default;
+
+    /// Collects the entities with an emissive material that can be sampled, see
+    /// Entity::sampleDirection().
+    explicit EmitterList(const std::vector<Entity*>& entities) {
+        std::vector<BoundingBox> bounds;
+        std::vector<double> power;
+        for (Entity* entity : entities) {
+            if (!entity->material->isEmissive() || entity->area() <= 0) continue;
+            _index[entity] = static_cast<uint32_t>(_emitters.size());
+            _emitters.push_back(entity);
+            bounds.push_back(entity->boundingBox());
+            // Radiant exitance of a diffuse emitter is pi times its radiance.
+            power.push_back(glm::pi<double>() * luminance(entity->material->emission) *
+                            entity->area());
+            _cdf.push_back(power.back() + (_cdf.empty() ? 0 : _cdf.back()));
+        }
+        _power = _cdf.empty() ? 0 : _cdf.back();
+        for (double& c : _cdf) c /= _power;
+        _tree = LightTree(bounds, power);
+    }
+
+    bool empty() const { return _emitters.empty(); }
+
+    size_t size() const { return _emitters.size(); }
+
+    const std::vector<Entity*>& emitters() const { return _emitters; }
+
+    /// Summed power of the emitters, counting the light they emit from one side.
+    double power() const { return _power; }
+
+    /// Selects an emitter to light a receiver at `point` with `normal` for a uniform value `u`,
+    /// and returns the probability in `probability`. Returns nullptr if no emitter can reach the
+    /// receiver.
+    Entity* select(const glm::dvec3& point, const glm::dvec3& normal, double u,
+                   double& probability) const {
+        uint32_t i;
+        if (!_tree.select(point, normal, u, i, probability)) return nullptr;
+        return _emitters[i];
+    }
+
+    /// Probability with which select() returns `entity` for the receiver, 0 if it is not in the
+    /// list.
+    double probability(const Entity* entity, const glm::dvec3& point,
+                       const glm::dvec3& normal) const {
+        auto it = _index.find(entity);
+        return it != _index.end() ? _tree.probability(it->second, point, normal) : 0;
+    }
+
+    /// Selects an emitter with a probability proportional to its power for a uniform value `u`,
+    /// e.g. to start a light path, and returns the probability in `probability`. Must not be
+    /// called on an empty list.
+    Entity* selectByPower(double u, double& probability) const {
+        size_t i = std::upper_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+        i = std::min(i, _cdf.size() - 1);
+        probability = _cdf[i] - (i > 0 ? _cdf[i - 1] : 0);
+        return _emitters[i];
+    }
+
+    /// Probability with which selectByPower() returns `entity`, 0 if it is not in the list.
+    double powerProbability(const Entity* entity) const {
+        auto it = _index.find(entity);
+        if (it == _index.end()) return 0;
+        return _cdf[it->second] - (it->second > 0 ? _cdf[it->second - 1] : 0);
+    }
+
+  private:
+    std::vector<Entity*> _emitters;
+    std::unordered_map<const Entity*, uint32_t> _index;
+    LightTree _tree;
+    /// Cumulative distribution of the power of the emitters.
+    std::vector<double> _cdf;
+    double _power = 0;
+};
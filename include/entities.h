@@ -1,26 +1,93 @@
 #pragma once
 
+#include <cmath>
+
 #include <glm/glm.hpp>
 
 #include "bbox.h"
+#include "hit.h"
 #include "material.h"
+#include "packet.h"
 #include "ray.h"
 
 /// A base class for all entities in the scene.
 struct Entity {
 
-    Entity() : material(Material(glm::dvec3(0, 0, 0), 1.0, glm::dvec4(1.0, 0.0, 0.0, 0.0), 0, MaterialType::Diffuse)) {}
-    Entity(const Material& material, double _radius) : material(material), radius(_radius) {}
+    Entity() : material(&defaultMaterial()) {}
+    /// Entities refer to their material, so that many can share one. It must outlive them.
+    Entity(const Material& material, double _radius) : material(&material), radius(_radius) {}
 
     /// Check if a ray intersects the object
     virtual bool intersect(const Ray& ray, double& intersectionDistance) { return 0; };
 
+    /// Check if a ray intersects the object closer than `hit.distance`, and if so record the hit.
+    virtual bool intersect(const Ray& ray, Hit& hit) {
+        double intersectionDistance;
+        if (!intersect(ray, intersectionDistance) || intersectionDistance >= hit.distance) {
+            return false;
+        }
+        hit.distance = intersectionDistance;
+        hit.entity = this;
+        return true;
+    }
+
+    /// Intersects all rays of a packet and records every hit closer than the ray's current hit.
+    virtual void intersect(RayPacket& packet) {
+        for (int i = 0; i < packet.size; ++i) intersect(packet.rays[i], packet.hits[i]);
+    }
+
+    /// Returns the surface normal at a point found by intersect(ray, hit).
+    virtual glm::dvec3 normal(const glm::dvec3& point, const Hit& /*hit*/) const {
+        return glm::normalize(point - pos);
+    }
+
+    /// Returns the material at a point found by intersect(ray, hit). Textured entities vary it over
+    /// their surface.
+    virtual Material materialAt(const glm::dvec3& /*point*/, const Hit& /*hit*/) const {
+        return *material;
+    }
+
     /// Returns an axis-aligned bounding box of the entity.
-    //virtual BoundingBox boundingBox() const = 0;
+    virtual BoundingBox boundingBox() const = 0;
+
+    /// Surface area, from which the power of emissive entities is computed. 0 if unknown.
+    virtual double area() const { return 0; }
+
+    /// Samples a direction from `point` towards the entity for direct lighting, using the uniform
+    /// values `u`, and returns its solid angle density in `pdf`. Returns false if no direction
+    /// could be sampled, e.g. for entities that cannot be lights.
+    virtual bool sampleDirection(const glm::dvec3& /*point*/,
+                                 const glm::dvec2& /*u*/,
+                                 glm::dvec3& /*direction*/,
+                                 double& /*pdf*/) const {
+        return false;
+    }
+
+    /// Solid angle density with which sampleDirection() samples the direction from `point` to
+    /// `lightPoint` on the entity. 0 if it cannot sample it.
+    virtual double directionPdf(const glm::dvec3& /*point*/,
+                                const glm::dvec3& /*lightPoint*/) const {
+        return 0;
+    }
+
+    /// Samples a point on the surface uniformly by area for the uniform values `u`, so that light
+    /// paths can start on the entity. Returns false if the entity cannot sample points.
+    virtual bool samplePoint(const glm::dvec2& /*u*/,
+                             glm::dvec3& /*point*/,
+                             glm::dvec3& /*normal*/) const {
+        return false;
+    }
 
     glm::dvec3 pos = {0, 0, 0};
-    Material material;
+    const Material* material;
     float radius;
+
+  private:
+    static const Material& defaultMaterial() {
+        static const Material material(glm::dvec3(0, 0, 0), 1.0, glm::dvec4(1.0, 0.0, 0.0, 0.0), 0,
+                                       MaterialType::Diffuse);
+        return material;
+    }
 };
 
 // TODO Implement implicit sphere
@@ -24,6 +24,9 @@ class Gui : public QMainWindow {
         _saveButton = new QPushButton("Save as ...", this);
         toolbar->addWidget(_saveButton);
 
+        _saveHeatmapButton = new QPushButton("Save heatmap as ...", this);
+        toolbar->addWidget(_saveHeatmapButton);
+
         QWidget* spacer = new QWidget();
         spacer->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
         toolbar->addWidget(spacer);
@@ -44,6 +47,14 @@ class Gui : public QMainWindow {
             _viewer->getImage().save(&file, "PNG");
         });
 
+        connect(_saveHeatmapButton, &QPushButton::clicked, [this]() {
+            QString filename = QFileDialog::getSaveFileName(this, tr("Save Heatmap"), "samples.png",
+                                                            tr("Images (*.png);;All Files (*)"));
+            QFile file(filename);
+            file.open(QIODevice::WriteOnly);
+            _viewer->getHeatmap().save(&file, "PNG");
+        });
+
         this->resize(width, height);
     }
 
@@ -54,5 +65,6 @@ class Gui : public QMainWindow {
   private:
     QLabel* _durationText;
     QPushButton* _saveButton;
+    QPushButton* _saveHeatmapButton;
     Viewer* _viewer;
 };
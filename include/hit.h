@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+struct Entity;
+
+/// Result of a closest-hit query, written into a record owned by the caller.
+struct Hit {
+    Entity* entity = nullptr;
+    /// Distance along the ray. Only hits closer than the initial value are reported.
+    double distance = INFINITY;
+    /// Primitive and barycentric coordinates of the hit for entities made of several primitives.
+    uint32_t primitive = 0;
+    glm::dvec2 uv = {0, 0};
+};
@@ -1,29 +1,65 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
 #include <QImage>
 
 #include <glm/glm.hpp>
 
+/// RGB image with 8 bits per channel. Render threads may set different pixels concurrently while
+/// the viewer displays copies of the image. Every pixel is one atomic word in the layout of QRgb,
+/// so that copies see each pixel either before or after it was set.
 struct Image {
     Image() = delete;
-    Image(int width, int height) : _image(width, height, QImage::Format_RGB888) { this->clear(); }
+    Image(int width, int height)
+        : _width(width), _height(height), _pixels(static_cast<size_t>(width) * height) {
+        clear();
+    }
 
-    int width() const { return _image.width(); }
-    int height() const { return _image.height(); }
+    int width() const { return _width; }
+    int height() const { return _height; }
 
     void setPixel(int x, int y, glm::dvec3 c) {
-        _image.setPixel(x, y, QColor((int)(255 * c.r), (int)(255 * c.g), (int)(255 * c.b)).rgb());
+        uint32_t rgb = kOpaque | toByte(c.r) << 16 | toByte(c.g) << 8 | toByte(c.b);
+        _pixels[index(x, y)].store(rgb, std::memory_order_relaxed);
     }
 
     glm::dvec3 getPixel(int x, int y) const {
-        auto p = _image.pixel(x, y);
-        return {qRed(p) / 255., qGreen(p) / 255., qBlue(p) / 255.};
+        uint32_t rgb = _pixels[index(x, y)].load(std::memory_order_relaxed);
+        return {(rgb >> 16 & 0xff) / 255., (rgb >> 8 & 0xff) / 255., (rgb & 0xff) / 255.};
+    }
+
+    void clear() {
+        for (auto& pixel : _pixels) pixel.store(kOpaque, std::memory_order_relaxed);
     }
 
-    void clear() { _image.fill(Qt::black); };
+    /// Returns a copy of the image for display or saving.
+    QImage toQImage() const {
+        QImage image(_width, _height, QImage::Format_RGB32);
+        for (int y = 0; y < _height; ++y) {
+            auto* line = reinterpret_cast<uint32_t*>(image.scanLine(y));
+            for (int x = 0; x < _width; ++x) {
+                line[x] = _pixels[index(x, y)].load(std::memory_order_relaxed);
+            }
+        }
+        return image;
+    }
 
   private:
-    QImage _image;
+    /// Alpha of QRgb, which Format_RGB32 expects to be opaque.
+    static constexpr uint32_t kOpaque = 0xff000000u;
+
+    size_t index(int x, int y) const { return static_cast<size_t>(y) * _width + x; }
+
+    /// Converts a color channel, clamping colors brighter than white.
+    static uint32_t toByte(double value) {
+        return static_cast<uint32_t>(std::min(255, std::max(0, static_cast<int>(255 * value))));
+    }
 
-    friend class Viewer;
+    int _width;
+    int _height;
+    std::vector<std::atomic<uint32_t>> _pixels;
 };
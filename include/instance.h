@@ -0,0 +1,68 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "entities.h"
+
+/// Places a shared entity, typically a TriangleMesh with its own BVH, into the scene through an
+/// affine transform. Rays are transformed into the object space of the shared entity, so copies of
+/// an asset only cost the inverse transform, the matrix for their normals and a reference to their
+/// material each.
+struct Instance : public Entity {
+    /// `object` and `material` must outlive the instance and may be shared by any number of
+    /// instances.
+    Instance(Entity* object, const glm::dmat4& transform, const Material& material)
+        : Entity(material, 0), _object(object), _inverse(glm::inverse(transform)),
+          // Normals transform with the inverse transpose.
+          _normalMatrix(glm::transpose(glm::dmat3(_inverse))) {
+        pos = glm::dvec3(transform * glm::dvec4(object->pos, 1));
+    }
+
+    bool intersect(const Ray& ray, double& intersectionDistance) override {
+        Hit hit;
+        if (!intersect(ray, hit)) return false;
+        intersectionDistance = hit.distance;
+        return true;
+    }
+
+    bool intersect(const Ray& ray, Hit& hit) override {
+        // The object space direction is not normalized, distances along it scale by its length.
+        glm::dvec3 dir = _inverse * glm::dvec4(ray.dir, 0);
+        double scale = glm::length(dir);
+        Ray local(_inverse * glm::dvec4(ray.origin, 1), dir);
+
+        Hit localHit;
+        localHit.distance = hit.distance * scale;
+        if (!_object->intersect(local, localHit)) return false;
+
+        hit = localHit;
+        hit.distance = localHit.distance / scale;
+        hit.entity = this;
+        return true;
+    }
+
+    glm::dvec3 normal(const glm::dvec3& point, const Hit& hit) const override {
+        glm::dvec3 localNormal = _object->normal(_inverse * glm::dvec4(point, 1), hit);
+        return glm::normalize(_normalMatrix * localNormal);
+    }
+
+    /// Only needed to build the scene, so the transform is recovered from the inverse.
+    BoundingBox boundingBox() const override {
+        glm::dmat4 transform = glm::inverse(glm::dmat4(_inverse));
+        BoundingBox local = _object->boundingBox();
+        BoundingBox bbox;
+        for (int i = 0; i < 8; ++i) {
+            glm::dvec3 corner((i & 1) ? local.max.x : local.min.x,
+                              (i & 2) ? local.max.y : local.min.y,
+                              (i & 4) ? local.max.z : local.min.z);
+            bbox.grow(glm::dvec3(transform * glm::dvec4(corner, 1)));
+        }
+        return bbox;
+    }
+
+  private:
+    Entity* _object;
+    /// World to object space; the last row of an affine transform is left out.
+    glm::dmat4x3 _inverse;
+    glm::dmat3 _normalMatrix;
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bbox.h"
+
+/// Irradiance at a point of a diffuse surface, sampled over the hemisphere above it, with its
+/// gradients for rotating and moving the surface [Ward and Heckbert 1992].
+struct IrradianceRecord {
+    glm::dvec3 point = glm::dvec3(0);
+    glm::dvec3 normal = glm::dvec3(0);
+    glm::dvec3 irradiance = glm::dvec3(0);
+    /// Harmonic mean distance of the surfaces around the point, within which the irradiance
+    /// changes little.
+    double radius = 0;
+    /// Change of the irradiance per rotation about an axis and per movement, column c holding the
+    /// gradient of color channel c. `d * gradient` is the change for a rotation or movement `d`.
+    glm::dmat3 rotationalGradient = glm::dmat3(0);
+    glm::dmat3 translationalGradient = glm::dmat3(0);
+};
+
+/// Cache of irradiance records for interpolating the slowly changing indirect light on diffuse
+/// surfaces [Ward et al. 1988]. Records are kept in an octree, every one in the nodes that its
+/// area of influence overlaps and that are about as large as that area, so a lookup only visits
+/// the records on the path from the root to the leaf that holds the point. The cache is filled
+/// while rendering: lookups from many threads share a lock, inserts take it exclusively.
+class IrradianceCache {
+  public:
+    /// Deepest level of the octree.
+    static constexpr int kMaxDepth = 16;
+
+    /// Creates an empty cache for records within `bounds`. `accuracy` is the largest error
+    /// allowed for interpolation, the `a` of Ward et al.: records count up to `accuracy` times
+    /// their radius away.
+    IrradianceCache(const BoundingBox& bounds, double accuracy)
+        : _root(bounds), _accuracy(accuracy) {}
+
+    size_t size() const {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        return _size;
+    }
+
+    /// Interpolates the irradiance at `point` on a surface with `normal` from the records close
+    /// enough to it, weighted by their estimated error. Returns false if there are none.
+    bool interpolate(const glm::dvec3& point, const glm::dvec3& normal,
+                     glm::dvec3& irradiance) const {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        if (!_root.bbox.contains(point)) return false;
+
+        glm::dvec3 sum(0);
+        double weights = 0;
+        for (const Node* node = &_root; node;) {
+            for (const IrradianceRecord& record : node->records) {
+                glm::dvec3 d = point - record.point;
+                double distance2 = glm::dot(d, d);
+                double extent = _accuracy * record.radius;
+                if (distance2 >= extent * extent) continue;
+                // Records in front of the point see other surroundings.
+                if (glm::dot(d, normal + record.normal) < -kFrontTolerance * record.radius) {
+                    continue;
+                }
+                double error = std::sqrt(distance2) / record.radius +
+                               std::sqrt(std::fmax(0.0, 1 - glm::dot(normal, record.normal)));
+                if (error >= _accuracy) continue;
+                double weight = error > 0 ? 1 / error : kMaxWeight;
+                sum += weight * (record.irradiance +
+                                 glm::cross(record.normal, normal) * record.rotationalGradient +
+                                 d * record.translationalGradient);
+                weights += weight;
+            }
+            node = node->isLeaf() ? nullptr : node->children[node->childIndex(point)].get();
+        }
+        if (weights <= 0) return false;
+        irradiance = glm::max(sum / weights, glm::dvec3(0));
+        return true;
+    }
+
+    /// Adds a record. Safe to call while other threads interpolate or insert.
+    void insert(const IrradianceRecord& record) {
+        std::unique_lock<std::shared_timed_mutex> lock(_mutex);
+        // Beyond this distance the error of the record exceeds the accuracy.
+        double extent = record.radius * _accuracy;
+        BoundingBox bounds(record.point - extent, record.point + extent);
+        if (!_root.bbox.intersect(bounds)) return;
+        insert(_root, record, bounds, 12 * extent * extent, 0);
+        ++_size;
+    }
+
+  private:
+    /// Records whose planes are this much behind the point, relative to their radius, still count.
+    static constexpr double kFrontTolerance = 0.05;
+    /// Weight of a record right at the point.
+    static constexpr double kMaxWeight = 1e10;
+
+    struct Node {
+        explicit Node(const BoundingBox& bbox) : bbox(bbox) {}
+
+        bool isLeaf() const { return children[0] == nullptr; }
+
+        int childIndex(const glm::dvec3& point) const {
+            glm::dvec3 c = bbox.center();
+            return (point.x > c.x ? 1 : 0) | (point.y > c.y ? 2 : 0) | (point.z > c.z ? 4 : 0);
+        }
+
+        /// Subdivides the node into 8 empty children.
+        void partition() {
+            glm::dvec3 c = bbox.center();
+            for (int i = 0; i < 8; ++i) {
+                glm::dvec3 min((i & 1) ? c.x : bbox.min.x, (i & 2) ? c.y : bbox.min.y,
+                               (i & 4) ? c.z : bbox.min.z);
+                glm::dvec3 max((i & 1) ? bbox.max.x : c.x, (i & 2) ? bbox.max.y : c.y,
+                               (i & 4) ? bbox.max.z : c.z);
+                children[i] = std::make_unique<Node>(BoundingBox(min, max));
+            }
+        }
+
+        BoundingBox bbox;
+        std::vector<IrradianceRecord> records;
+        std::array<std::unique_ptr<Node>, 8> children;
+    };
+
+    /// Stores the record in the nodes below `node` that overlap its `bounds` and whose children
+    /// would be smaller than them, compared by squared diagonals.
+    void insert(Node& node, const IrradianceRecord& record, const BoundingBox& bounds,
+                double diagonal2, int depth) {
+        glm::dvec3 half = (node.bbox.max - node.bbox.min) * 0.5;
+        if (depth == kMaxDepth || glm::dot(half, half) < diagonal2) {
+            node.records.push_back(record);
+            return;
+        }
+        if (node.isLeaf()) node.partition();
+        for (auto& child : node.children) {
+            if (child->bbox.intersect(bounds)) insert(*child, record, bounds, diagonal2, depth + 1);
+        }
+    }
+
+    mutable std::shared_timed_mutex _mutex;
+    Node _root;
+    double _accuracy;
+    size_t _size = 0;
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bbox.h"
+#include "random.h"
+
+/// Binary hierarchy over lights given by their bounds and power, for picking the lights that
+/// matter at a shading point without looking at all of them. Every node bounds its lights with a
+/// sphere and sums their power. Seen from a shading point, the sphere subtends a cone of
+/// directions, which bounds the cosine at the receiver. Together with the distance this gives an
+/// upper bound of the light a node can contribute, its importance. Lights here emit in all
+/// directions (point lights, spheres and two-sided quads), so nodes need no emission cone.
+///
+/// Descending from the root, choosing every child with a probability proportional to its
+/// importance, selects a light in O(log n) with a probability close to its contribution.
+class LightTree {
+  public:
+    LightTree() = default;
+
+    /// Builds the hierarchy over the lights with the given bounds and power, both indexed by light.
+    LightTree(const std::vector<BoundingBox>& bounds, const std::vector<double>& power) {
+        if (bounds.empty()) return;
+
+        std::vector<uint32_t> lights(bounds.size());
+        for (size_t i = 0; i < lights.size(); ++i) lights[i] = static_cast<uint32_t>(i);
+        _nodes.reserve(2 * lights.size() - 1);
+        _leaves.resize(lights.size());
+        build(bounds, power, lights.begin(), lights.end(), 0, 0);
+    }
+
+    bool empty() const { return _nodes.empty(); }
+
+    /// Selects a light for the shading point with a probability proportional to the importance
+    /// of the nodes on its way, using the uniform value `u`. A zero `normal` means the receiver
+    /// takes light from all directions. Returns false if no light can reach the point.
+    bool select(const glm::dvec3& point, const glm::dvec3& normal, double u, uint32_t& light,
+                double& probability) const {
+        probability = 0;
+        if (_nodes.empty() || importance(_nodes[0], point, normal) <= 0) return false;
+        return descend(0, point, normal, u, light, probability);
+    }
+
+    /// Probability with which select() picks `light` at the shading point.
+    double probability(uint32_t light, const glm::dvec3& point, const glm::dvec3& normal) const {
+        if (_nodes.empty() || importance(_nodes[0], point, normal) <= 0) return 0;
+
+        const Leaf& leaf = _leaves[light];
+        double probability = 1;
+        uint32_t index = 0;
+        for (int depth = 0; depth < leaf.depth; ++depth) {
+            const Node& node = _nodes[index];
+            double left = importance(_nodes[index + 1], point, normal);
+            double right = importance(_nodes[node.right], point, normal);
+            if (left + right <= 0) return 0;
+            bool isRight = (leaf.path >> depth) & 1;
+            probability *= (isRight ? right : left) / (left + right);
+            index = isRight ? node.right : index + 1;
+        }
+        return probability;
+    }
+
+    /// Visits a cut through the hierarchy for a shading point: nodes whose bounding sphere
+    /// appears smaller than `ratio` times its distance are represented by one light picked from
+    /// them with select()'s probabilities, all other lights are visited individually. `visit(light,
+    /// weight)` receives the lights with the weight that keeps the sum of their contributions
+    /// unbiased. `seed` makes the random choices a function of the shading point. A ratio of 0
+    /// visits every light.
+    template <typename Visitor>
+    void cut(const glm::dvec3& point, const glm::dvec3& normal, double ratio, uint64_t seed,
+             Visitor visit) const {
+        if (_nodes.empty()) return;
+
+        // Every inner node replaces itself with its two children.
+        std::array<uint32_t, kMaxDepth + 1> stack;
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            uint32_t index = stack[--size];
+            const Node& node = _nodes[index];
+            if (node.isLeaf()) {
+                visit(node.light, 1.0);
+                continue;
+            }
+            double distance = glm::length(node.center - point);
+            if (node.radius < ratio * distance) {
+                uint32_t light;
+                double probability;
+                double u = toUnit(hash64(seed + kGamma * (index + 1)));
+                if (descend(index, point, normal, u, light, probability)) {
+                    visit(light, 1 / probability);
+                }
+                continue;
+            }
+            stack[size++] = node.right;
+            stack[size++] = index + 1;
+        }
+    }
+
+  private:
+    /// Deepest level of the hierarchy. Median splits keep it at log2 of the number of lights.
+    static constexpr int kMaxDepth = 64;
+    /// Odd constant that spaces the random values of the nodes of a cut, as in RandomStream.
+    static constexpr uint64_t kGamma = 0x9E3779B97F4A7C15ull;
+
+    struct Node {
+        glm::dvec3 center;
+        double radius;
+        double power;
+        uint32_t right = 0; // right child of inner nodes, the left one follows its parent
+        uint32_t light = 0; // light of leaves
+
+        bool isLeaf() const { return right == 0; }
+    };
+
+    /// Way from the root to the leaf of a light, bit i is set if it goes right at depth i.
+    struct Leaf {
+        uint64_t path = 0;
+        int depth = 0;
+    };
+
+    /// Upper bound of the light a node contributes to a receiver at `point` with `normal`.
+    static double importance(const Node& node, const glm::dvec3& point,
+                             const glm::dvec3& normal) {
+        glm::dvec3 d = node.center - point;
+        double distance2 = glm::dot(d, d);
+        double radius2 = node.radius * node.radius;
+        double cosine = 1;
+        if (distance2 > radius2 && normal != glm::dvec3(0)) {
+            // Cosine of the smallest angle between the normal and a direction into the sphere
+            double distance = std::sqrt(distance2);
+            double cosAxis = glm::dot(normal, d) / distance;
+            double sinBound = node.radius / distance;
+            double cosBound = std::sqrt(1 - sinBound * sinBound);
+            if (cosAxis < cosBound) {
+                double sinAxis = std::sqrt(std::max(0.0, 1 - cosAxis * cosAxis));
+                cosine = cosAxis * cosBound + sinAxis * sinBound;
+                if (cosine <= 0) return 0;
+            }
+        }
+        return node.power * cosine / std::max(distance2, radius2);
+    }
+
+    /// Selects a light below the node at `index` for a uniform value `u`, see select().
+    bool descend(uint32_t index, const glm::dvec3& point, const glm::dvec3& normal, double u,
+                 uint32_t& light, double& probability) const {
+        probability = 1;
+        while (!_nodes[index].isLeaf()) {
+            const Node& node = _nodes[index];
+            double left = importance(_nodes[index + 1], point, normal);
+            double right = importance(_nodes[node.right], point, normal);
+            if (left + right <= 0) return false;
+            double p = left / (left + right);
+            // Reuse u for the next level, rescaled to [0, 1)
+            if (u < p) {
+                u /= p;
+                probability *= p;
+                index = index + 1;
+            } else {
+                u = (u - p) / (1 - p);
+                probability *= 1 - p;
+                index = node.right;
+            }
+            u = std::min(u, 1 - 1e-16);
+        }
+        light = _nodes[index].light;
+        return true;
+    }
+
+    /// Builds the subtree over the lights in [begin, end) by splitting them at the median of the
+    /// longest axis of their centers. Returns the index of its root.
+    uint32_t build(const std::vector<BoundingBox>& bounds, const std::vector<double>& power,
+                   std::vector<uint32_t>::iterator begin, std::vector<uint32_t>::iterator end,
+                   uint64_t path, int depth) {
+        BoundingBox bbox, centers;
+        double sum = 0;
+        for (auto it = begin; it != end; ++it) {
+            bbox.grow(bounds[*it]);
+            centers.grow(bounds[*it].center());
+            sum += power[*it];
+        }
+
+        uint32_t index = static_cast<uint32_t>(_nodes.size());
+        Node node;
+        node.center = bbox.center();
+        node.radius = glm::length(bbox.max - bbox.min) * 0.5;
+        node.power = sum;
+        _nodes.push_back(node);
+
+        if (end - begin == 1) {
+            _nodes[index].light = *begin;
+            _leaves[*begin] = {path, depth};
+            return index;
+        }
+
+        int axis = centers.dx() > centers.dy() ? (centers.dx() > centers.dz() ? 0 : 2)
+                                               : (centers.dy() > centers.dz() ? 1 : 2);
+        auto middle = begin + (end - begin) / 2;
+        std::nth_element(begin, middle, end, [&](uint32_t a, uint32_t b) {
+            return bounds[a].center()[axis] < bounds[b].center()[axis];
+        });
+
+        build(bounds, power, begin, middle, path, depth + 1);
+        uint32_t right = build(bounds, power, middle, end, path | (1ull << depth), depth + 1);
+        _nodes[index].right = right;
+        return index;
+    }
+
+    std::vector<Node> _nodes;
+    std::vector<Leaf> _leaves;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cmath>
+
 #include <glm/glm.hpp>
 
 /// Represents the material properties of an entity. For now it only contains color, but it should
@@ -14,16 +16,38 @@ struct Material {
                       MaterialType _type,
                       glm::dvec3 emission = glm::dvec3(0))
         : color(std::move(color)), refractive_index(refractiveIndex), albedo(albedo),
-          specular_exponent(specularExponent), materialType(_type) {}
+          specular_exponent(specularExponent), materialType(_type), emission(emission) {}
 
     Material()
         : refractive_index(1), albedo(1, 0, 0, 0), color(), specular_exponent(),
           materialType(MaterialType::Diffuse), emission(glm::dvec3(0)) {}
 
+    /// Diffuse material with a checkerboard of squares with side `size` in texture space.
+    static Material checkerboard(glm::dvec3 color, glm::dvec3 checkerColor, double size) {
+        Material material;
+        material.color = color;
+        material.checkerColor = checkerColor;
+        material.checkerSize = size;
+        return material;
+    }
+
+    bool isEmissive() const { return emission != glm::dvec3(0); }
+
+    /// Returns the color at the texture coordinates `st`.
+    glm::dvec3 colorAt(const glm::dvec2& st) const {
+        if (checkerSize <= 0) return color;
+        int cell = static_cast<int>(std::floor(st.x / checkerSize)) +
+                   static_cast<int>(std::floor(st.y / checkerSize));
+        return cell & 1 ? checkerColor : color;
+    }
+
     glm::dvec4 albedo;
     glm::dvec3 color;
     double refractive_index;
     double specular_exponent;
     MaterialType materialType;
     glm::dvec3 emission;
+    /// Color of every other square of a checkerboard, see colorAt(). A size of 0 disables it.
+    glm::dvec3 checkerColor = glm::dvec3(0);
+    double checkerSize = 0;
 };
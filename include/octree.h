@@ -1,28 +1,82 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <memory>
 #include <vector>
 
 #include <glm/glm.hpp>
 
+#include "accelerator.h"
 #include "bbox.h"
 #include "entities.h"
 
-class Octree {
+class Octree : public Accelerator {
   public:
-    Octree(glm::dvec3 min, glm::dvec3 max) : _root(Node({min, max})) {}
+    /// Deepest level a node may be split to; bounds the traversal stack.
+    static constexpr int kMaxDepth = 16;
+
+    /// Entities are stored in every leaf their bounding box overlaps. A leaf is split once it holds
+    /// more than `maxLeafSize` entities, unless it already sits at `maxDepth`.
+    Octree(glm::dvec3 min, glm::dvec3 max, int maxDepth = 8, size_t maxLeafSize = 8)
+        : _root(Node({min, max})), _maxDepth(maxDepth < kMaxDepth ? maxDepth : kMaxDepth),
+          _maxLeafSize(maxLeafSize) {}
 
     /// Store an entity in the correct position of the octree.
     void push_back(Entity* object) {
-        // TODO Implement this
-        _root._entities.push_back(object);
+        _entities.push_back(object);
+        BoundingBox bbox = object->boundingBox();
+        if (_root._bbox.contains(bbox)) {
+            insert(_root, object, bbox, 0);
+        } else {
+            // Rays may hit the part outside of the root without ever entering the tree.
+            _outside.push_back(object);
+        }
     }
 
-    /// Returns list of entities that have the possibility to be intersected by the ray.
-    std::vector<Entity*> intersect(const Ray& ray) const {
-        // TODO Implement this
-        return _root._entities;
+    /// All entities stored in the octree.
+    const std::vector<Entity*>& entities() const override { return _entities; }
+
+    bool intersect(const Ray& ray,
+                   Hit& hit,
+                   bool (*skip)(const Entity*) = nullptr) const override {
+        bool found = false;
+        auto test = [&](Entity* e) {
+            if ((!skip || !skip(e)) && e->intersect(ray, hit)) found = true;
+        };
+        for (Entity* e : _outside) test(e);
+        // Cells are visited front to back, and traversal stops as soon as the hit found so far is
+        // closer than the next cell.
+        traverse(ray, hit.distance, [&](const Node& leaf, double& tMax) {
+            for (Entity* e : leaf._entities) test(e);
+            tMax = hit.distance;
+            return true;
+        });
+        return found;
+    }
+
+    bool occluded(const Ray& ray,
+                  double tMax,
+                  bool (*skip)(const Entity*) = nullptr) const override {
+        auto hits = [&](Entity* e) {
+            double dist_i;
+            return (!skip || !skip(e)) && e->intersect(ray, dist_i) && dist_i < tMax;
+        };
+        for (Entity* e : _outside) {
+            if (hits(e)) return true;
+        }
+        bool found = false;
+        traverse(ray, tMax, [&](const Node& leaf, double&) {
+            for (Entity* e : leaf._entities) {
+                if (hits(e)) {
+                    found = true;
+                    return false;
+                }
+            }
+            return true;
+        });
+        return found;
     }
 
   private:
@@ -30,8 +84,16 @@ class Octree {
         explicit Node(const BoundingBox& bbox) : _bbox(bbox) {}
 
         /// Subdivides the current node into 8 children.
-        void partition(){
-            // TODO Implement this
+        void partition() {
+            glm::dvec3 c = _bbox.center();
+            for (int i = 0; i < 8; ++i) {
+                glm::dvec3 min((i & 1) ? c.x : _bbox.min.x, (i & 2) ? c.y : _bbox.min.y,
+                               (i & 4) ? c.z : _bbox.min.z);
+                glm::dvec3 max((i & 1) ? _bbox.max.x : c.x, (i & 2) ? _bbox.max.y : c.y,
+                               (i & 4) ? _bbox.max.z : c.z);
+                _children[i] = std::make_unique<Node>(BoundingBox(min, max));
+                _childBounds[i / 4].set(i % 4, _children[i]->_bbox);
+            }
         };
 
         bool is_leaf() const { return _children[0] == nullptr; }
@@ -39,7 +101,77 @@ class Octree {
         BoundingBox _bbox;
         std::vector<Entity*> _entities;
         std::array<std::unique_ptr<Node>, 8> _children;
+        std::array<BoundingBox4, 2> _childBounds; // children 0-3 and 4-7, for SIMD traversal
     };
 
+    void insert(Node& node, Entity* object, const BoundingBox& bbox, int depth) {
+        if (!node.is_leaf()) {
+            for (auto& child : node._children) {
+                if (child->_bbox.intersect(bbox)) insert(*child, object, bbox, depth + 1);
+            }
+            return;
+        }
+
+        node._entities.push_back(object);
+        if (node._entities.size() <= _maxLeafSize || depth >= _maxDepth) return;
+
+        node.partition();
+        std::vector<Entity*> entities;
+        entities.swap(node._entities);
+        for (Entity* e : entities) insert(node, e, e->boundingBox(), depth);
+    }
+
+    /// Visits the leaves pierced by the ray front to back. `visit(leaf, tMax)` may lower tMax, and
+    /// stops the traversal by returning false; cells starting beyond tMax are skipped.
+    template <typename Visitor>
+    void traverse(const Ray& ray, double tMax, Visitor visit) const {
+        struct Entry {
+            const Node* node;
+            double tNear;
+        };
+        // Every level pushes at most 8 children, of which one is popped right away.
+        std::array<Entry, 7 * kMaxDepth + 8> stack;
+        int size = 0;
+
+        double tNear, tFar;
+        if (!_root._bbox.intersect(ray, tNear, tFar) || tNear > tMax) return;
+        stack[size++] = {&_root, tNear};
+        PackedRay packed(ray);
+
+        while (size > 0) {
+            Entry entry = stack[--size];
+            if (entry.tNear > tMax) continue;
+
+            const Node& node = *entry.node;
+            if (node.is_leaf()) {
+                if (!visit(node, tMax)) return;
+                continue;
+            }
+
+            // Test all 8 children with two 4-wide slab tests.
+            float childNear[8];
+            int mask = node._childBounds[0].intersect(packed, static_cast<float>(tMax), childNear);
+            mask |= node._childBounds[1].intersect(packed, static_cast<float>(tMax), childNear + 4)
+                    << 4;
+
+            std::array<Entry, 8> hits;
+            int count = 0;
+            for (int c = 0; c < 8; ++c) {
+                const Node* child = node._children[c].get();
+                if (!(mask & (1 << c)) || (child->is_leaf() && child->_entities.empty())) continue;
+                // Insertion sort by decreasing distance, so that the nearest child is pushed last
+                // and visited next.
+                int i = count++;
+                for (; i > 0 && hits[i - 1].tNear < childNear[c]; --i) hits[i] = hits[i - 1];
+                hits[i] = {child, childNear[c]};
+            }
+            for (int i = 0; i < count; ++i) stack[size++] = hits[i];
+        }
+    }
+
     Node _root;
+    int _maxDepth;
+    size_t _maxLeafSize;
+    std::vector<Entity*> _entities;
+    std::vector<Entity*> _outside;
 };
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "bbox.h"
+#include "hit.h"
+#include "ray.h"
+
+/// Pyramid bounded by four planes through a common ray origin. Boxes entirely outside of it
+/// cannot be hit by any ray inside of it.
+struct Frustum {
+    Frustum() = default;
+
+    /// `corners` are the directions of the outermost rays, given in order around the pyramid.
+    Frustum(const glm::dvec3& origin, const std::array<glm::dvec3, 4>& corners) : origin(origin) {
+        axis = glm::normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+        for (int i = 0; i < 4; ++i) {
+            glm::dvec3 n = glm::cross(corners[i], corners[(i + 1) % 4]);
+            double length = glm::length(n);
+            // Coinciding corners, e.g. of a single column of pixels, give no plane to cull with.
+            n = length > 0 ? n / length : glm::dvec3(0);
+            planes[i] = glm::dot(n, axis) < 0 ? -n : n;
+        }
+    }
+
+    /// Checks if the box may overlap the frustum. The test is conservative: boxes near the edges
+    /// may pass although they are outside.
+    bool overlaps(const BoundingBox& bbox) const {
+        for (const glm::dvec3& n : planes) {
+            // The corner of the box farthest along the inward plane normal.
+            glm::dvec3 corner(n.x >= 0 ? bbox.max.x : bbox.min.x,
+                              n.y >= 0 ? bbox.max.y : bbox.min.y,
+                              n.z >= 0 ? bbox.max.z : bbox.min.z);
+            if (glm::dot(n, corner - origin) < -kSlack) return false;
+        }
+        return true;
+    }
+
+    /// Returns a bit mask of the lanes whose box may overlap the frustum, see overlaps().
+    int overlaps(const BoundingBox4& boxes) const {
+        double distance[4] = {INFINITY, INFINITY, INFINITY, INFINITY};
+        for (const glm::dvec3& n : planes) {
+            const float* x = boxes.bounds[n.x >= 0][0];
+            const float* y = boxes.bounds[n.y >= 0][1];
+            const float* z = boxes.bounds[n.z >= 0][2];
+            for (int lane = 0; lane < 4; ++lane) {
+                double d = n.x * (x[lane] - origin.x) + n.y * (y[lane] - origin.y) +
+                           n.z * (z[lane] - origin.z);
+                distance[lane] = d < distance[lane] ? d : distance[lane];
+            }
+        }
+        int mask = 0;
+        for (int lane = 0; lane < 4; ++lane) mask |= !(distance[lane] < -kSlack) << lane;
+        return mask;
+    }
+
+    glm::dvec3 origin;
+    glm::dvec3 axis;                  // normalized mean direction
+    std::array<glm::dvec3, 4> planes; // inward normals of the side planes
+
+  private:
+    /// Tolerance for rays on the edges of the frustum, whose directions are rounded.
+    static constexpr double kSlack = 1e-6;
+};
+
+/// Bundle of up to kMaxSize rays with a common origin, e.g. the primary rays of a block of pixels,
+/// together with their closest hits. Coherent rays visit mostly the same accelerator nodes, so a
+/// packet pays for one node visit instead of one per ray and culls nodes against its frustum. The
+/// directions are also kept in structure-of-arrays layout for primitive tests over all rays.
+struct RayPacket {
+    static constexpr int kMaxSize = 64;
+
+    explicit RayPacket(const glm::dvec3& origin) : origin(origin) {}
+
+    /// Removes all rays. The four corner directions must enclose all rays added afterwards.
+    void reset(const std::array<glm::dvec3, 4>& corners) {
+        size = 0;
+        frustum = Frustum(origin, corners);
+    }
+
+    void push_back(const glm::dvec3& direction) {
+        rays[size] = Ray(origin, direction);
+        packed[size] = PackedRay(rays[size]);
+        for (int axis = 0; axis < 3; ++axis) dir[axis][size] = rays[size].dir[axis];
+        hits[size] = Hit();
+        ++size;
+    }
+
+    /// Checks if any ray hits the box before its current closest hit.
+    bool mayHit(const BoundingBox& bbox) const {
+        if (!frustum.overlaps(bbox)) return false;
+        double tNear, tFar;
+        for (int i = 0; i < size; ++i) {
+            if (bbox.intersect(rays[i], tNear, tFar) && tNear <= hits[i].distance) return true;
+        }
+        return false;
+    }
+
+    /// Returns a bit mask of the lanes whose box is hit by any ray before its current closest hit,
+    /// and writes the entry distance of the first such ray of every lane to tNear.
+    int mayHit(const BoundingBox4& boxes, float tNear[4]) const {
+        int remaining = frustum.overlaps(boxes);
+        int mask = 0;
+        float t[4];
+        for (int i = 0; i < size && remaining; ++i) {
+            int hit = boxes.intersect(packed[i], static_cast<float>(hits[i].distance), t);
+            hit &= remaining;
+            for (int lane = 0; lane < 4; ++lane) {
+                if (hit & (1 << lane)) tNear[lane] = t[lane];
+            }
+            mask |= hit;
+            remaining &= ~hit;
+        }
+        return mask;
+    }
+
+    glm::dvec3 origin;
+    Frustum frustum;
+    int size = 0;
+    std::array<Ray, kMaxSize> rays;
+    std::array<PackedRay, kMaxSize> packed;
+    /// Normalized ray directions per axis.
+    double dir[3][kMaxSize];
+    /// Closest hit of every ray. Only hits closer than the initial distance are reported.
+    std::array<Hit, kMaxSize> hits;
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "scheduler.h"
+
+/// Light carried to a surface point by one photon of a photon map [Jensen 1996]. Stored in single
+/// precision with a quantized direction, as maps hold millions of photons.
+struct Photon {
+    Photon() = default;
+    Photon(const glm::dvec3& position, const glm::dvec3& power, const glm::dvec3& direction)
+        : position(position), power(power) {
+        for (int i = 0; i < 3; ++i) {
+            _direction[i] = static_cast<int8_t>(std::lround(direction[i] * 127));
+        }
+    }
+
+    /// Direction the photon travelled in when it hit the surface.
+    glm::vec3 direction() const {
+        return glm::vec3(_direction[0], _direction[1], _direction[2]) * (1 / 127.f);
+    }
+
+    glm::vec3 position = glm::vec3(0);
+    glm::vec3 power = glm::vec3(0);
+    /// Axis at which the node of the photon splits the kd-tree.
+    uint8_t axis = 0;
+
+  private:
+    int8_t _direction[3] = {0, 0, 0};
+};
+
+/// Photons in a balanced kd-tree for density estimation. The tree is implicit in the order of the
+/// photons: the root of the photons in a range is the one in its middle, and its subtrees are the
+/// halves before and after it. The tree needs no pointers, and every subtree is stored in one
+/// piece, so the photons near a query point, which it visits last, share cache lines.
+class PhotonMap {
+  public:
+    PhotonMap() = default;
+
+    /// Builds the tree over `photons`, splitting subtrees on up to `threads` threads.
+    PhotonMap(std::vector<Photon> photons, unsigned threads) : _photons(std::move(photons)) {
+        // The top levels are split in order, their subtrees in parallel.
+        std::vector<Subtree> subtrees;
+        build(0, _photons.size(), 0, &subtrees);
+        TaskScheduler::run(subtrees.size(), threads, [&](size_t i, unsigned) {
+            build(subtrees[i].begin, subtrees[i].end, kParallelDepth, nullptr);
+        });
+    }
+
+    bool empty() const { return _photons.empty(); }
+
+    size_t size() const { return _photons.size(); }
+
+    /// Bytes taken by the photons.
+    size_t memoryUsage() const { return _photons.capacity() * sizeof(Photon); }
+
+    /// Estimates the irradiance at `point` on a surface with `normal` from the `k` photons closest
+    /// to it within `maxRadius`: their power over the area of the disc that holds them. Photons
+    /// that hit the surface from behind do not count.
+    glm::dvec3 irradiance(const glm::dvec3& point, const glm::dvec3& normal, int k,
+                          double maxRadius) const {
+        if (_photons.empty() || k <= 0) return glm::dvec3(0);
+
+        Query query;
+        query.point = glm::vec3(point);
+        query.k = k < kMaxNearest ? k : kMaxNearest;
+        query.radius2 = static_cast<float>(maxRadius * maxRadius);
+        locate(0, _photons.size(), query);
+
+        // The farthest of k photons lies on the border of their disc and is left out, which
+        // makes the estimate unbiased for evenly spread photons. With fewer than k photons in
+        // reach, the disc of the maximum radius holds all of them.
+        bool full = query.size == query.k;
+        glm::vec3 normalf(normal);
+        glm::dvec3 power(0);
+        for (int i = full ? 1 : 0; i < query.size; ++i) {
+            const Photon& photon = _photons[query.nearest[i].index];
+            if (glm::dot(photon.direction(), normalf) < 0) power += glm::dvec3(photon.power);
+        }
+        double radius2 = full ? query.radius2 : maxRadius * maxRadius;
+        return power / (glm::pi<double>() * radius2);
+    }
+
+  private:
+    /// Largest number of photons a query gathers.
+    static constexpr int kMaxNearest = 256;
+    /// Depth at which subtrees are built in parallel, giving up to 2^depth tasks.
+    static constexpr int kParallelDepth = 6;
+
+    struct Subtree {
+        size_t begin, end;
+    };
+
+    struct Neighbor {
+        float distance2;
+        uint32_t index;
+
+        bool operator<(const Neighbor& other) const { return distance2 < other.distance2; }
+    };
+
+    /// State of a k nearest neighbor query. The photons found are a max-heap on their distance,
+    /// so the farthest one is replaced when a closer one turns up.
+    struct Query {
+        glm::vec3 point;
+        int k;
+        /// Squared distance within which photons are searched: the maximum radius until k
+        /// photons are found, then the distance of the farthest of them.
+        float radius2;
+        int size = 0;
+        std::array<Neighbor, kMaxNearest> nearest;
+    };
+
+    /// Orders the photons in [begin, end) into a subtree, splitting them at the longest axis of
+    /// their bounds. Subtrees at kParallelDepth are added to `subtrees` instead, if it is given.
+    void build(size_t begin, size_t end, int depth, std::vector<Subtree>* subtrees) {
+        if (begin == end) return;
+        if (subtrees && depth == kParallelDepth) {
+            subtrees->push_back({begin, end});
+            return;
+        }
+
+        glm::vec3 min(INFINITY), max(-INFINITY);
+        for (size_t i = begin; i < end; ++i) {
+            min = glm::min(min, _photons[i].position);
+            max = glm::max(max, _photons[i].position);
+        }
+        glm::vec3 extent = max - min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                       : (extent.y > extent.z ? 1 : 2);
+
+        size_t middle = begin + (end - begin) / 2;
+        auto first = _photons.begin();
+        std::nth_element(first + begin, first + middle, first + end,
+                         [axis](const Photon& a, const Photon& b) {
+                             return a.position[axis] < b.position[axis];
+                         });
+        _photons[middle].axis = static_cast<uint8_t>(axis);
+
+        build(begin, middle, depth + 1, subtrees);
+        build(middle + 1, end, depth + 1, subtrees);
+    }
+
+    /// Adds the photons of the subtree over [begin, end) that are closer than the farthest photon
+    /// found so far, visiting the side of the split that holds the query point first.
+    void locate(size_t begin, size_t end, Query& query) const {
+        size_t middle = begin + (end - begin) / 2;
+        const Photon& photon = _photons[middle];
+        if (end - begin > 1) {
+            float d = query.point[photon.axis] - photon.position[photon.axis];
+            if (d < 0) {
+                locate(begin, middle, query);
+                if (d * d < query.radius2 && middle + 1 < end) locate(middle + 1, end, query);
+            } else {
+                if (middle + 1 < end) locate(middle + 1, end, query);
+                if (d * d < query.radius2) locate(begin, middle, query);
+            }
+        }
+
+        glm::vec3 d = photon.position - query.point;
+        float distance2 = glm::dot(d, d);
+        if (distance2 >= query.radius2) return;
+        auto nearest = query.nearest.begin();
+        uint32_t index = static_cast<uint32_t>(middle);
+        if (query.size < query.k) {
+            nearest[query.size++] = {distance2, index};
+            std::push_heap(nearest, nearest + query.size);
+            if (query.size == query.k) query.radius2 = nearest[0].distance2;
+            return;
+        }
+        std::pop_heap(nearest, nearest + query.size);
+        nearest[query.size - 1] = {distance2, index};
+        std::push_heap(nearest, nearest + query.size);
+        query.radius2 = nearest[0].distance2;
+    }
+
+    std::vector<Photon> _photons;
+};
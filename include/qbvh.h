@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "bbox.h"
+#include "bvh.h"
+
+/// Four-wide bounding volume hierarchy. It is collapsed from a binary SAH BVHTree, and every node
+/// keeps the bounds of its up to four children in a BoundingBox4, so that one node visit tests
+/// all children with a single vector slab test. This keeps SIMD lanes busy for incoherent rays,
+/// where packets of rays do not help. Has the same interface as BVHTree.
+class QBVHTree {
+  public:
+    QBVHTree() = default;
+
+    explicit QBVHTree(const std::vector<BoundingBox>& bounds,
+                      unsigned threads = std::thread::hardware_concurrency()) {
+        BVHTree binary(bounds, threads);
+        _order = binary.order();
+        if (binary.nodes().empty()) return;
+
+        _bounds = binary.bounds();
+        _nodes.reserve(binary.nodes().size() / 2 + 1);
+        collapse(binary, 0);
+    }
+
+    const std::vector<uint32_t>& order() const { return _order; }
+
+    BoundingBox bounds() const { return _bounds; }
+
+    /// Visits the leaves whose bounds are hit by the ray, nearest child first. `visit(begin, end,
+    /// tMax)` receives the range of leaf positions of a leaf. It may lower tMax, and stops the
+    /// traversal by returning false; nodes beyond tMax are skipped.
+    template <typename Visitor>
+    void traverse(const Ray& ray, double tMax, Visitor visit) const {
+        double tNear, tFar;
+        if (_nodes.empty() || !_bounds.intersect(ray, tNear, tFar) || tNear > tMax) return;
+
+        struct Entry {
+            uint32_t child; // node index, or first leaf position for leaves
+            uint32_t count; // number of primitives, 0 for inner nodes
+            double tNear;
+        };
+        // Every inner node replaces itself with at most four children.
+        std::array<Entry, 3 * BVHTree::kMaxDepth + 4> stack;
+        int size = 0;
+        stack[size++] = {0, 0, tNear};
+        PackedRay packed(ray);
+
+        while (size > 0) {
+            Entry entry = stack[--size];
+            if (entry.tNear > tMax) continue;
+
+            if (entry.count > 0) {
+                if (!visit(entry.child, entry.child + entry.count, tMax)) return;
+                continue;
+            }
+
+            const Node& node = _nodes[entry.child];
+            float childNear[4];
+            int mask = node.bounds.intersect(packed, static_cast<float>(tMax), childNear);
+
+            // Insertion sort by decreasing distance, so that the nearest child is pushed last and
+            // visited next.
+            int first = size;
+            for (int c = 0; c < 4; ++c) {
+                if (!(mask & (1 << c))) continue;
+                int i = size++;
+                for (; i > first && stack[i - 1].tNear < childNear[c]; --i) stack[i] = stack[i - 1];
+                stack[i] = {node.child[c], node.count[c], childNear[c]};
+            }
+        }
+    }
+
+    /// Visits the leaves that any ray of the packet may hit before its current closest hit,
+    /// nearest child first. `visit(begin, end)` receives the range of leaf positions of a leaf.
+    template <typename Visitor>
+    void traverse(const RayPacket& packet, Visitor visit) const {
+        if (_nodes.empty() || !packet.mayHit(_bounds)) return;
+
+        struct Entry {
+            uint32_t child;
+            uint32_t count;
+            float tNear; // entry distance of the first ray that hits the child
+        };
+        std::array<Entry, 3 * BVHTree::kMaxDepth + 4> stack;
+        int size = 0;
+        stack[size++] = {0, 0, 0};
+
+        while (size > 0) {
+            Entry entry = stack[--size];
+            if (entry.count > 0) {
+                visit(entry.child, entry.child + entry.count);
+                continue;
+            }
+
+            const Node& node = _nodes[entry.child];
+            float childNear[4];
+            int mask = packet.mayHit(node.bounds, childNear);
+
+            int first = size;
+            for (int c = 0; c < 4; ++c) {
+                if (!(mask & (1 << c))) continue;
+                int i = size++;
+                for (; i > first && stack[i - 1].tNear < childNear[c]; --i) stack[i] = stack[i - 1];
+                stack[i] = {node.child[c], node.count[c], childNear[c]};
+            }
+        }
+    }
+
+  private:
+    struct Node {
+        BoundingBox4 bounds;
+        std::array<uint32_t, 4> child{}; // node index, or first leaf position for leaves
+        std::array<uint32_t, 4> count{}; // number of primitives, 0 for inner nodes
+    };
+
+    /// Turns the subtree of a binary inner node into wide nodes and returns the wide node index.
+    /// Children are pulled up from the binary tree by opening the inner child with the largest
+    /// surface area until a node has four children.
+    uint32_t collapse(const BVHTree& binary, uint32_t binaryIndex) {
+        const std::vector<BVHTree::Node>& nodes = binary.nodes();
+
+        std::array<uint32_t, 4> children;
+        int count = 0;
+        if (nodes[binaryIndex].is_leaf()) {
+            children[count++] = binaryIndex;
+        } else {
+            children[count++] = nodes[binaryIndex].first;
+            children[count++] = nodes[binaryIndex].first + 1;
+        }
+        while (count < 4) {
+            int largest = -1;
+            double largestArea = -1;
+            for (int i = 0; i < count; ++i) {
+                const BVHTree::Node& child = nodes[children[i]];
+                if (!child.is_leaf() && child.bbox.surfaceArea() > largestArea) {
+                    largest = i;
+                    largestArea = child.bbox.surfaceArea();
+                }
+            }
+            if (largest < 0) break;
+            uint32_t opened = children[largest];
+            children[largest] = nodes[opened].first;
+            children[count++] = nodes[opened].first + 1;
+        }
+
+        uint32_t index = static_cast<uint32_t>(_nodes.size());
+        _nodes.emplace_back();
+        for (int i = 0; i < count; ++i) {
+            const BVHTree::Node& child = nodes[children[i]];
+            // Recursion may reallocate the node array, so the node is looked up again every time.
+            uint32_t target = child.is_leaf() ? child.first : collapse(binary, children[i]);
+            Node& node = _nodes[index];
+            node.bounds.set(i, child.bbox);
+            node.child[i] = target;
+            node.count[i] = child.is_leaf() ? child.count : 0;
+        }
+        return index;
+    }
+
+    BoundingBox _bounds;
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _order;
+};
+
+/// Scene accelerator on a QBVHTree.
+using QBVH = BVHAccelerator<QBVHTree>;
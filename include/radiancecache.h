@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include <glm/glm.hpp>
+
+#include "random.h"
+#include "scheduler.h"
+
+/// Radiance that diffuse surfaces reflect, averaged over the cells of a world-space hash grid
+/// [Binder et al. 2018]. Paths add the light they carry back to their diffuse vertices, and later
+/// paths end at a cell that holds enough of it, instead of bouncing on. The table has a fixed
+/// number of cells and is updated without locks: cells are claimed by compare-and-swap on their
+/// key and sum in fixed point. The sums of a pass are only read after decay() blends them into
+/// the running means, which forget old passes, so the first, noisy estimates fade out.
+class RadianceCache {
+  public:
+    /// Creates an empty cache with `cells` cells, rounded up to a power of 2.
+    explicit RadianceCache(size_t cells) {
+        size_t size = 1;
+        while (size < cells) size *= 2;
+        _cells.reset(new Cell[size]);
+        _mask = size - 1;
+    }
+
+    /// Key of the cell that holds `point` on a surface with `normal`, for cells of at least
+    /// `size`. Sizes are rounded up to powers of 2, and the dominant axis of the normal and its
+    /// sign tell the sides of thin walls apart.
+    static uint64_t key(const glm::dvec3& point, const glm::dvec3& normal, double size) {
+        int level = static_cast<int>(std::ceil(std::log2(size)));
+        level = std::min(std::max(level, -kLevelOffset), kLevelOffset - 1);
+        glm::dvec3 a = glm::abs(normal);
+        int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        uint64_t side = static_cast<uint64_t>(axis * 2 + (normal[axis] < 0 ? 1 : 0));
+        uint64_t key = kOccupied | static_cast<uint64_t>(level + kLevelOffset) << 57 | side << 54;
+        for (int i = 0; i < 3; ++i) {
+            auto c = static_cast<int64_t>(std::floor(std::ldexp(point[i], -level)));
+            key |= (static_cast<uint64_t>(c) & kCoordinateMask) << (18 * i);
+        }
+        return key;
+    }
+
+    /// Mean radiance of the cell with `key` over the last passes. Returns false if the cell has
+    /// too few samples to end paths at.
+    bool lookup(uint64_t key, glm::dvec3& radiance) const {
+        const Cell* cell = find(key);
+        if (!cell || cell->weight < kMinWeight) return false;
+        radiance = glm::dvec3(cell->radiance);
+        return true;
+    }
+
+    /// Adds a sample of the radiance in the cell with `key`. The sample is dropped if the cell is
+    /// new and the cells it may take are held by others. Safe to call from many threads.
+    void add(uint64_t key, const glm::dvec3& radiance) {
+        Cell* cell = claim(key);
+        if (!cell) return;
+        for (int c = 0; c < 3; ++c) {
+            // Extreme values would dominate the cell for many passes, NaNs are dropped.
+            double v = std::fmin(std::fmax(radiance[c], 0.0), kMaxValue);
+            if (v > 0) cell->sum[c].fetch_add(std::llround(v * kScale), std::memory_order_relaxed);
+        }
+        cell->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// Blends the samples added since the last call into the means of their cells, weighting
+    /// earlier samples down by kDecay, and frees cells whose weight faded away. Must not run
+    /// while paths use the cache; splits the table over up to `threads` threads.
+    void decay(unsigned threads) {
+        size_t size = _mask + 1;
+        size_t tasks = (size + kDecayBatch - 1) / kDecayBatch;
+        TaskScheduler::run(tasks, threads, [&](size_t task, unsigned) {
+            size_t end = std::min(size, (task + 1) * kDecayBatch);
+            for (size_t i = task * kDecayBatch; i < end; ++i) {
+                Cell& cell = _cells[i];
+                if (cell.key.load(std::memory_order_relaxed) == 0) continue;
+                uint32_t count = cell.count.exchange(0, std::memory_order_relaxed);
+                glm::dvec3 sum(0);
+                for (int c = 0; c < 3; ++c) {
+                    sum[c] = cell.sum[c].exchange(0, std::memory_order_relaxed) / kScale;
+                }
+                double weight = kDecay * cell.weight;
+                if (count == 0 && weight < kMinEvictWeight) {
+                    cell.key.store(0, std::memory_order_relaxed);
+                    cell.weight = 0;
+                    cell.radiance = glm::vec3(0);
+                    continue;
+                }
+                glm::dvec3 total = weight * glm::dvec3(cell.radiance) + sum;
+                cell.weight = static_cast<float>(weight + count);
+                cell.radiance = glm::vec3(total / (weight + count));
+            }
+        });
+    }
+
+    /// Bytes taken by the table.
+    size_t memoryUsage() const { return (_mask + 1) * sizeof(Cell); }
+
+  private:
+    /// Weight that the samples of a pass keep in the next one. Lower values follow changes
+    /// faster but average fewer samples.
+    static constexpr double kDecay = 0.8;
+    /// Samples, weighted by their decay, that a cell needs before paths end at it.
+    static constexpr float kMinWeight = 8;
+    /// Weight below which cells that got no samples in a pass are freed for other keys.
+    static constexpr double kMinEvictWeight = 0.5;
+    /// Cells a key may take, following the one it hashes to.
+    static constexpr size_t kProbes = 8;
+    /// Cells that one task of decay() visits.
+    static constexpr size_t kDecayBatch = 16384;
+    /// Fixed point scale of the sums, as in SplatBuffer.
+    static constexpr double kScale = double(1 << 24);
+    /// Largest value of a sample.
+    static constexpr double kMaxValue = 1e4;
+    /// Keys hold the level of the cell size in 6 bits, the side of the surface in 3, 18 bits per
+    /// coordinate and this bit, so that no key is 0, which marks free cells.
+    static constexpr uint64_t kOccupied = uint64_t(1) << 63;
+    static constexpr int kLevelOffset = 32;
+    static constexpr uint64_t kCoordinateMask = (uint64_t(1) << 18) - 1;
+
+    struct Cell {
+        std::atomic<uint64_t> key{0};
+        /// Samples added in the current pass.
+        std::atomic<int64_t> sum[3] = {{0}, {0}, {0}};
+        std::atomic<uint32_t> count{0};
+        /// Mean of the previous passes and the decayed number of samples it holds. Only
+        /// written by decay().
+        float weight = 0;
+        glm::vec3 radiance = glm::vec3(0);
+    };
+
+    const Cell* find(uint64_t key) const {
+        size_t first = static_cast<size_t>(hash64(key));
+        for (size_t i = 0; i < kProbes; ++i) {
+            const Cell& cell = _cells[(first + i) & _mask];
+            if (cell.key.load(std::memory_order_relaxed) == key) return &cell;
+        }
+        return nullptr;
+    }
+
+    /// Finds the cell with `key`, or takes the first free cell for it. Freed cells leave gaps,
+    /// so the key is looked for in all cells it may take first.
+    Cell* claim(uint64_t key) {
+        if (const Cell* cell = find(key)) return const_cast<Cell*>(cell);
+        size_t first = static_cast<size_t>(hash64(key));
+        for (size_t i = 0; i < kProbes; ++i) {
+            Cell& cell = _cells[(first + i) & _mask];
+            uint64_t expected = 0;
+            if (cell.key.compare_exchange_strong(expected, key, std::memory_order_relaxed) ||
+                expected == key) {
+                return &cell;
+            }
+        }
+        return nullptr;
+    }
+
+    std::unique_ptr<Cell[]> _cells;
+    size_t _mask = 0;
+};
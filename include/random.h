@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+/// Finalizer of SplitMix64. It is a bijection that scrambles all bits, so it turns counters into
+/// random looking values without collisions.
+inline uint64_t hash64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/// Maps 64 random bits to a uniformly distributed value in [0, 1).
+inline double toUnit(uint64_t bits) { return (bits >> 11) * (1.0 / (1ull << 53)); }
+
+/// Counter-based random numbers for Monte Carlo sampling. Every draw is a pure function of the
+/// pixel, the sample index and the dimension, i.e. the number of values drawn before it for the
+/// same sample. Images therefore do not depend on the number of threads or the order in which
+/// tiles are rendered, and no state is shared between threads.
+class RandomStream {
+  public:
+    RandomStream(uint32_t pixel, uint32_t sample)
+        : _key(hash64(uint64_t(pixel) << 32 | sample)), _dimension(0) {}
+
+    /// Uniformly distributed value in [0, 1).
+    double next() { return toUnit(nextUInt64()); }
+
+    /// Uniformly distributed 64-bit value.
+    uint64_t nextUInt64() { return hash64(_key + kGamma * ++_dimension); }
+
+    /// Number of values drawn so far.
+    uint32_t dimension() const { return _dimension; }
+
+  private:
+    /// Odd constant of SplitMix64 that spaces the counters of consecutive dimensions.
+    static constexpr uint64_t kGamma = 0x9E3779B97F4A7C15ull;
+
+    uint64_t _key;
+    uint32_t _dimension;
+};
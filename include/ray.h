@@ -1,10 +1,20 @@
 #pragma once
 
+#include <utility>
+
 #include <glm/glm.hpp>
 
 struct Ray {
-    Ray(glm::dvec3 origin, glm::dvec3 dir) : origin(std::move(origin)), dir(glm::normalize(dir)) {}
+    Ray() = default;
+    Ray(glm::dvec3 origin, glm::dvec3 dir) : origin(std::move(origin)), dir(glm::normalize(dir)) {
+        invDir = 1.0 / this->dir;
+        sign[0] = invDir.x < 0;
+        sign[1] = invDir.y < 0;
+        sign[2] = invDir.z < 0;
+    }
 
     glm::dvec3 origin;
-    glm::dvec3 dir; // normalized directional vector
+    glm::dvec3 dir;    // normalized directional vector
+    glm::dvec3 invDir; // 1 / dir, infinite along axes the ray is parallel to
+    int sign[3];       // 1 for axes along which dir is negative
 };
@@ -1,15 +1,31 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <thread>
+#include <vector>
 //#include <future>
 
 #include <glm/glm.hpp>
 
+#include "accelerator.h"
+#include "bdpt.h"
 #include "camera.h"
+#include "emitters.h"
 #include "entities.h"
 #include "image.h"
-#include "octree.h"
+#include "irradiancecache.h"
+#include "lighttree.h"
+#include "packet.h"
+#include "photonmap.h"
+#include "radiancecache.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "sppm.h"
 
 #include <Light.h>
 #include <cmath>
@@ -17,45 +33,145 @@
 #include <iostream>
 #include <random>
 
-double erand48(unsigned short xsubi[3]) { return (double)rand() / (double)RAND_MAX; }
-
 #define M_PI 3.1415926f
 
+/// Weighting of the two ways the path tracer finds light at diffuse surfaces: sampling a light
+/// directly and hitting it with the bounce ray [Veach 1997].
+enum class Mis {
+    None,    ///< Only direct light sampling counts, bounce rays ignore the lights they hit.
+    Balance, ///< Weights proportional to the densities of the strategies.
+    Power,   ///< Weights proportional to the squared densities of the strategies.
+};
+
+/// Algorithms the ray tracer renders an image with.
+enum class Integrator {
+    Whitted,       ///< Recursive ray tracing with point lights, one sample per pixel.
+    PathTracing,   ///< Progressive Monte Carlo path tracing with area lights.
+    Bidirectional, ///< Path tracing that also connects paths traced from the lights.
+    PhotonMapping, ///< Photon maps for caustics and indirect light, with final gathering.
+    ProgressivePhotonMapping, ///< Passes of camera and photon tracing with shrinking radii.
+};
+
 class RayTracer {
   public:
     RayTracer() = delete;
     RayTracer(const Camera& camera, std::vector<Light*> lights)
-        : _camera(camera), _lights(lights), _image(std::make_shared<Image>(0, 0)){};
+        : _camera(camera), _lights(lights), _image(std::make_shared<Image>(0, 0)),
+          _heatmap(std::make_shared<Image>(0, 0)) {
+        std::vector<BoundingBox> bounds;
+        std::vector<double> power;
+        for (const Light* light : _lights) {
+            bounds.emplace_back(light->position, light->position);
+            power.push_back(light->intensity);
+        }
+        _lightTree = LightTree(bounds, power);
+    }
 
-    void setScene(const Octree* scene) { _scene = scene; }
+    void setScene(const Accelerator* scene) {
+        _scene = scene;
+        _emitters = EmitterList(scene->entities());
+        BoundingBox bounds;
+        for (const Entity* entity : scene->entities()) bounds.grow(entity->boundingBox());
+        _sceneCenter = bounds.center();
+        _sceneRadius = glm::length(bounds.max - bounds.min) * 0.5;
+    }
 
+    /// Renders an image of `w` x `h` pixels with the selected integrator. Returns when it is done
+    /// or stop() was called.
     void run(int w, int h) {
-        _image = std::make_shared<Image>(w, h);
+        // The viewer reads the images while the last ones are replaced.
+        std::atomic_store(&_image, std::make_shared<Image>(w, h));
+        std::atomic_store(&_heatmap, std::make_shared<Image>(w, h));
+        _progressiveMemory = 0;
 
-        glm::dvec3 forward = _camera.forward;
-        glm::dvec3 right = glm::normalize(glm::cross(forward, _camera.up));
-        glm::dvec3 up = glm::cross(right, forward);
+        Frame frame(_camera, w, h);
+        switch (_integrator) {
+        case Integrator::Whitted:
+            renderWhitted(frame);
+            break;
+        case Integrator::PathTracing:
+            renderPaths(frame);
+            break;
+        case Integrator::Bidirectional:
+            renderBidirectional(frame);
+            break;
+        case Integrator::PhotonMapping:
+            renderPhotonMap(frame);
+            break;
+        case Integrator::ProgressivePhotonMapping:
+            renderProgressivePhotons(frame);
+            break;
+        }
+    }
 
-        double _h = tan(25.0 * M_PI / 180.0);
-        double aspectRatio = (double)w / (double)h;
-        double _w = _h * aspectRatio;
+    /// Selects how pixels are rendered.
+    void setIntegrator(Integrator integrator) { _integrator = integrator; }
 
-        // The structure of the for loop should remain for incremental rendering.
-        for (int y = 0; y < h && _running; ++y) {
-            for (int x = 0; x < w && _running; ++x) {
+    /// Largest number of samples per pixel the path tracer accumulates, one per pass over the
+    /// image.
+    void setSamples(int samples) { _samples = samples; }
 
-                glm::dvec2 screenCoord((2.0 * x) / (double)w - 1.0f, (-2.0 * y) / (double)h + 1.0);
-                Ray ray(_camera.pos, (forward + screenCoord.x * _w * right + screenCoord.y * _h * up));
-                unsigned short Xi[3] = {0, 0, y * y * y};
+    /// Selects the point set the path tracer draws its sample values from.
+    void setSampler(SamplerType sampler) { _sampler = sampler; }
 
-                glm::dvec3 pixelColor = traceRay(ray);
-                //glm::dvec3 pixelColor = radiance(ray, 0, Xi);
+    /// Selects how the path tracer weights light sampling against bounce rays that hit lights.
+    void setMis(Mis mis) { _mis = mis; }
 
-                _image->setPixel(x, y, pixelColor);
-            }
-        }
+    /// Number of first bounces at which the path tracer follows both the reflected and the
+    /// refracted ray of a dielectric. Later bounces choose one of them at random.
+    void setSplitBounces(int bounces) {
+        _splitBounces = bounces < kMaxSplitBounces ? bounces : kMaxSplitBounces;
+    }
+
+    /// Enables adaptive sampling: the path tracer stops sampling a pixel once the estimated
+    /// relative error of its mean drops below `threshold`. 0 samples every pixel equally.
+    void setAdaptiveThreshold(double threshold) { _adaptiveThreshold = threshold; }
+
+    /// The Whitted integrator skips reflected and refracted rays whose contribution to the pixel
+    /// is weighted by less than `threshold`. 0 traces the full ray tree.
+    void setPruneThreshold(double threshold) { _pruneThreshold = threshold; }
+
+    /// Sets how small, relative to its distance, a cluster of Whitted lights must appear to be
+    /// shaded with one light picked from it instead of all of them. 0 shades every light.
+    void setLightCut(double ratio) { _lightCut = ratio; }
+
+    /// Number of photons emitted for the global and for the caustic photon map. Caustic photons
+    /// are only stored if they reach a diffuse surface through specular surfaces alone.
+    void setPhotons(int photons, int causticPhotons) {
+        _photonCount = photons;
+        _causticPhotonCount = causticPhotons;
+    }
+
+    /// Enables the irradiance cache of the path tracer for the indirect light at the diffuse
+    /// surfaces that camera paths reach. `accuracy` is the largest error allowed for reusing a
+    /// record, smaller values take more records; 0 disables the cache. Every record samples
+    /// the hemisphere with `rays` paths.
+    void setIrradianceCache(double accuracy, int rays) {
+        _irradianceAccuracy = accuracy;
+        _irradianceRays = rays;
+    }
+
+    /// Enables the radiance cache of the path tracer: paths end at the diffuse surfaces they reach
+    /// after `bounces` bounces, with the light that earlier paths carried back from there, if
+    /// the cache holds enough of it. 0 disables the cache.
+    void setRadianceCache(int bounces) { _radianceCacheBounces = std::max(bounces, 0); }
+
+    /// Number of photons every pass of progressive photon mapping emits, 0 for one per pixel.
+    void setPassPhotons(int photons) { _passPhotons = photons; }
+
+    /// Number of rays the photon mapper gathers the indirect light of a diffuse point with, per
+    /// sample. 0 reads it from the global photon map at the point itself.
+    void setFinalGather(int rays) { _gatherRays = rays; }
+
+    /// Number of threads that render tiles, 0 for one per hardware thread.
+    void setThreads(unsigned threads) {
+        _threads = threads > 0 ? threads : std::thread::hardware_concurrency();
     }
 
+    /// Traces the primary rays of `size` x `size` pixel blocks together as a packet. Values of 0
+    /// or 1 trace every ray on its own.
+    void setPacketSize(int size) { _packetSize = size < kMaxPacketSize ? size : kMaxPacketSize; }
+
     glm::dvec3 refract(const glm::dvec3& I, const glm::dvec3& N, const float eta_t, const float eta_i = 1.f) {
         // Snell's law
         float cosi = -std::max(-1.0, std::min(1.0, glm::dot(I, N)));
@@ -71,116 +187,98 @@ class RayTracer {
         return k < 0 ? glm::dvec3(1, 0, 0) : tempI.operator*=(eta) + tempN.operator*=((eta * cosi - sqrtf(k)));
     }
 
-    bool intersect(const Ray& ray, glm::dvec3& hitPoint, glm::dvec3& hitNormal, Material& material) {
-        double spheres_dist = INFINITY;
-        for (auto& e : _scene->intersect(ray)) {
-            if (e->pos.x == 0 && !isPathTracing) {
-                continue;
-            }
-            double dist_i;
-            if (e->intersect(ray, dist_i) && (dist_i < spheres_dist)) {
-                spheres_dist = dist_i;
-                hitPoint = ray.origin + (ray.dir * dist_i);
-                hitNormal = glm::normalize(hitPoint - e->pos);
-                material = e->material;
-            }            
-        }
-
-        // PLANES
-        double checkerboard_dist = INFINITY;
-        
-        // BACK
-        if (fabs(ray.dir.z) > 1e-3) {
-            double d = -(ray.origin.z + 30) / ray.dir.z;
-            glm::dvec3 pt = ray.origin + ray.dir * d;
-            if (d > 0 && fabs(pt.y) < 10 && pt.x < 10 && pt.x > -10 && d < spheres_dist) {
-                checkerboard_dist = d;
-                hitPoint = pt;
-                hitNormal = glm::dvec3(0, 0, 1);
-                material.color = (int(.5 * hitPoint.x + 1000) + int(.5 * hitPoint.y)) & 1
-                                     ? glm::dvec3(.4, .4, .5)
-                                     : glm::dvec3(.4, .4, .5);
-            }
-        }
-        // BOTTOM
-        if (fabs(ray.dir.y) > 1e-3) {
-            double d = -(ray.origin.y + 10) / ray.dir.y;
-            glm::dvec3 pt = ray.origin + ray.dir * d;
-            if (d > 0 && fabs(pt.x) < 10 && pt.z < 0 && pt.z > -30 && d < spheres_dist) {
-                checkerboard_dist = d;
-                hitPoint = pt;
-                hitNormal = glm::dvec3(0, 1, 0);
-                material.color = (int(.5 * hitPoint.x + 1000) + int(.5 * hitPoint.z)) & 1
-                                     ? glm::dvec3(.3, .3, .3)
-                                     : glm::dvec3(.3, .2, .1);
-            }
-        }
-        // RIGHT
-        if (fabs(ray.dir.x) > 1e-3) {
-            double d = -(ray.origin.x - 10) / ray.dir.x;
-            glm::dvec3 pt = ray.origin + ray.dir * d;
-            if (d > 0 && fabs(pt.y) < 10 && pt.z < 0 && pt.z > -30 && d < spheres_dist) {
-                checkerboard_dist = d;
-                hitPoint = pt;
-                hitNormal = glm::dvec3(-1, 0, 0);
-                material.color = (int(.5 * hitPoint.x + 1000) + int(.5 * hitPoint.z)) & 1
-                                     ? glm::dvec3(.1, .5, .1)
-                                     : glm::dvec3(.1, .5, .1);
-            }
-        }
-        // LEFT
-        if (fabs(ray.dir.x) > 1e-3) {
-            double d = -(ray.origin.x + 10) / ray.dir.x;
-            glm::dvec3 pt = ray.origin + ray.dir * d;
-            if (d > 0 && fabs(pt.y) < 10 && pt.z < 0 && pt.z > -30 && d < spheres_dist) {
-                checkerboard_dist = d;
-                hitPoint = pt;
-                hitNormal = glm::dvec3(1, 0, 0);
-                material.color = (int(.5 * hitPoint.x + 1000) + int(.5 * hitPoint.z)) & 1
-                                     ? glm::dvec3(.5, .1, .1)
-                                     : glm::dvec3(.5, .1, .1);
-            }
-        }
-        // TOP
-        if (fabs(ray.dir.y) > 1e-3) {
-            double d = -(ray.origin.y - 10) / ray.dir.y;
-            glm::dvec3 pt = ray.origin + ray.dir * d;
-            if (d > 0 && fabs(pt.x) < 10 && pt.z < 0 && pt.z > -30 && d < spheres_dist) {
-                checkerboard_dist = d;
-                hitPoint = pt;
-                hitNormal = glm::dvec3(0, -1, 0);
-                material.color = (int(.5 * hitPoint.x + 1000) + int(.5 * hitPoint.z)) & 1
-                                     ? glm::dvec3(.2, .2, .5)
-                                     : glm::dvec3(.2, .2, .5);
-            }
-        }
-        
+    /// Finds the closest hit of a ray, ignoring the entities for which `skip` returns true.
+    bool intersect(const Ray& ray,
+                   glm::dvec3& hitPoint,
+                   glm::dvec3& hitNormal,
+                   Material& material,
+                   bool (*skip)(const Entity*) = nullptr) {
+        Hit hit;
+        _scene->intersect(ray, hit, skip);
+        return resolveHit(ray, hit, hitPoint, hitNormal, material);
+    }
+
+    /// Computes the hit information of the closest hit of a ray in the scene.
+    bool resolveHit(const Ray& ray,
+                    const Hit& hit,
+                    glm::dvec3& hitPoint,
+                    glm::dvec3& hitNormal,
+                    Material& material) {
+        if (!hit.entity) return false;
+        hitPoint = ray.origin + (ray.dir * hit.distance);
+        hitNormal = hit.entity->normal(hitPoint, hit);
+        material = hit.entity->materialAt(hitPoint, hit);
+        return hit.distance < 1000;
+    }
 
-        return std::min(spheres_dist, checkerboard_dist) < 1000;
+    /// Checks if anything blocks the ray before `tMax`. Unlike intersect() this stops at the first
+    /// blocker found and computes no shading information.
+    bool occluded(const Ray& ray, double tMax, bool (*skip)(const Entity*) = nullptr) {
+        return _scene->occluded(ray, tMax, skip);
     }
 
-    glm::dvec3 traceRay(const Ray& ray, size_t depth = 0) {
-        isPathTracing = false;
+    /// Traces a ray whose color contributes to the pixel with `weight`. Adds the number of rays
+    /// traced to `rays`.
+    glm::dvec3 traceRay(const Ray& ray, int& rays, size_t depth = 0, double weight = 1) {
         glm::dvec3 nearestIntersectionPoint, nearestNormal;
         Material material;
 
-        if (depth > 4 || !intersect(ray, nearestIntersectionPoint, nearestNormal, material)) {
+        // Lights are only part of the scene for the path tracer.
+        if (depth > 4) return glm::dvec3(.9, .9, .9); // background color
+        ++rays;
+        if (!intersect(ray, nearestIntersectionPoint, nearestNormal, material, isEmitter)) {
             return glm::dvec3(.9, .9, .9); // background color
         }
+        return shade(ray, depth, weight, nearestIntersectionPoint, nearestNormal, material, rays);
+    }
 
-        glm::dvec3 reflect_dir = glm::normalize(reflect(ray.dir, nearestNormal));
-        glm::dvec3 refract_dir = glm::normalize(refract(ray.dir, nearestNormal, material.refractive_index));
+    /// Traces a primary ray whose closest hit in the scene is already known.
+    glm::dvec3 traceRay(const Ray& ray, const Hit& hit, int& rays) {
+        glm::dvec3 nearestIntersectionPoint, nearestNormal;
+        Material material;
+
+        ++rays;
+        if (!resolveHit(ray, hit, nearestIntersectionPoint, nearestNormal, material)) {
+            return glm::dvec3(.9, .9, .9); // background color
+        }
+        return shade(ray, 0, 1, nearestIntersectionPoint, nearestNormal, material, rays);
+    }
 
-        glm::dvec3 reflect_orig = glm::dot(reflect_dir, nearestNormal) < 0 ? nearestIntersectionPoint - nearestNormal * 1e-3 : nearestIntersectionPoint + nearestNormal * 1e-3;
-        glm::dvec3 refract_orig = glm::dot(refract_dir, nearestNormal) < 0 ? nearestIntersectionPoint - nearestNormal * 1e-3 : nearestIntersectionPoint + nearestNormal * 1e-3;
+    /// Whitted-style shading of a hit, tracing reflected, refracted and shadow rays. Secondary
+    /// rays that would contribute to the pixel with a weight below the prune threshold are
+    /// skipped, e.g. the refraction of opaque materials.
+    glm::dvec3 shade(const Ray& ray,
+                     size_t depth,
+                     double weight,
+                     const glm::dvec3& nearestIntersectionPoint,
+                     const glm::dvec3& nearestNormal,
+                     const Material& material,
+                     int& rays) {
+        glm::dvec3 reflect_color, refract_color;
+        double reflect_weight = weight * material.albedo[2];
+        double refract_weight = weight * material.albedo[3];
 
-        glm::dvec3 reflect_color = traceRay(Ray(reflect_orig, reflect_dir), depth + 1);
-        glm::dvec3 refract_color = traceRay(Ray(refract_orig, refract_dir), depth + 1);
+        if (reflect_weight >= _pruneThreshold) {
+            glm::dvec3 reflect_dir = glm::normalize(reflect(ray.dir, nearestNormal));
+            glm::dvec3 reflect_orig = glm::dot(reflect_dir, nearestNormal) < 0 ? nearestIntersectionPoint - nearestNormal * 1e-3 : nearestIntersectionPoint + nearestNormal * 1e-3;
+            reflect_color =
+                traceRay(Ray(reflect_orig, reflect_dir), rays, depth + 1, reflect_weight);
+        }
+        if (refract_weight >= _pruneThreshold) {
+            glm::dvec3 refract_dir = glm::normalize(refract(ray.dir, nearestNormal, material.refractive_index));
+            glm::dvec3 refract_orig = glm::dot(refract_dir, nearestNormal) < 0 ? nearestIntersectionPoint - nearestNormal * 1e-3 : nearestIntersectionPoint + nearestNormal * 1e-3;
+            refract_color =
+                traceRay(Ray(refract_orig, refract_dir), rays, depth + 1, refract_weight);
+        }
 
         double diffuse_light_intensity = 0, specular_light_intensity = 0;
 
-        // Iterate over lights
-        for (auto& e : _lights) {
+        // Iterate over a cut through the light tree. The specular term does not vanish behind the
+        // surface, so the receiver takes light from all directions.
+        uint64_t seed = pointKey(nearestIntersectionPoint);
+        _lightTree.cut(nearestIntersectionPoint, glm::dvec3(0), _lightCut, seed,
+                       [&](uint32_t index, double lightWeight) {
+            const Light* e = _lights[index];
 
             glm::dvec3 light_dir = glm::normalize((e->position - nearestIntersectionPoint));
             double light_distance = glm::length(e->position - nearestIntersectionPoint);
@@ -188,49 +286,567 @@ class RayTracer {
 
             
             // Shadows
-            glm::dvec3 shadow_pt, shadow_N;
-            Material tmpmaterial;
-            if (intersect(Ray(shadow_orig, light_dir), shadow_pt, shadow_N, tmpmaterial) && glm::length(shadow_pt - shadow_orig) < light_distance)
-                continue;
+            ++rays;
+            if (occluded(Ray(shadow_orig, light_dir), light_distance, isEmitter))
+                return;
             
-            diffuse_light_intensity += e->intensity * std::max(0.0, glm::dot(light_dir, nearestNormal));
-            specular_light_intensity += powf(std::max(0.0, glm::dot(-glm::reflect(-light_dir, nearestNormal), ray.dir)), material.specular_exponent) * e->intensity;
-        }
+            double intensity = e->intensity * lightWeight;
+            diffuse_light_intensity += intensity * std::max(0.0, glm::dot(light_dir, nearestNormal));
+            specular_light_intensity += powf(std::max(0.0, glm::dot(-glm::reflect(-light_dir, nearestNormal), ray.dir)), material.specular_exponent) * intensity;
+        });
 
         return material.color * diffuse_light_intensity * material.albedo[0] + glm::dvec3(1.0, 1.0, 1.0) * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
     }
 
-    glm::dvec3 radiance(const Ray& ray, int depth, unsigned short* Xi, double E = 1.0) {
-        isPathTracing = true;
-        glm::dvec3 intersectionPoint, normal;
-        Material material;
+    /// Whether a run may go on. Render threads poll it, stop() clears it from another thread.
+    bool running() const { return _running->load(std::memory_order_relaxed); }
+    void stop() { _running->store(false, std::memory_order_relaxed); }
+    void start() { _running->store(true, std::memory_order_relaxed); }
 
-        if (!intersect(ray, intersectionPoint, normal, material)) {
-            return glm::dvec3(.9, .9, .9); // background color
+    std::shared_ptr<Image> getImage() const { return std::atomic_load(&_image); }
+
+    /// Samples taken per pixel by the path tracer, from black for none to white for the maximum.
+    std::shared_ptr<Image> getHeatmap() const { return std::atomic_load(&_heatmap); }
+
+    /// Mean number of rays traced per sample in the last run, shadow rays included. Samples are
+    /// paths for the path tracer and pixels for the Whitted integrator.
+    double raysPerSample() const { return _raysPerSample; }
+
+    /// Bytes taken by the photon maps of the last run, or by the visible points of progressive
+    /// photon mapping.
+    size_t photonMemory() const {
+        return _globalMap.memoryUsage() + _causticMap.memoryUsage() + _progressiveMemory;
+    }
+
+  private:
+    /// Running mean and variance of the samples of a pixel. The variance is tracked for the
+    /// luminance only.
+    struct PixelEstimate {
+        void add(const glm::dvec3& sample) {
+            float l = static_cast<float>(luminance(sample));
+            sum += glm::vec3(sample);
+            luminanceSum += l;
+            luminanceSquares += l * l;
+            ++count;
         }
 
-        if (++depth > 10) {
-            return glm::dvec3(0);
+        glm::dvec3 mean() const { return glm::dvec3(sum) / double(count); }
+
+        /// Standard error of the mean luminance relative to the mean. Dark pixels are compared
+        /// with an absolute error, so that black regions converge as well.
+        double relativeError() const {
+            double mean = luminanceSum / count;
+            double variance = std::max(0.0, luminanceSquares / count - mean * mean);
+            return std::sqrt(variance / count) / std::max(mean, 0.1);
+        }
+
+        glm::vec3 sum = glm::vec3(0);
+        double luminanceSum = 0;
+        double luminanceSquares = 0;
+        int count = 0;
+        bool converged = false;
+    };
+
+    /// Black-red-yellow-white color ramp for t in [0, 1].
+    static glm::dvec3 heat(double t) { return {3 * t, 3 * t - 1, 3 * t - 2}; }
+
+    /// Image that run() renders, split into square tiles.
+    struct Frame {
+        Frame(const Camera& camera, int width, int height)
+            : width(width), height(height),
+              plane(camera, width, height, tan(25.0 * M_PI / 180.0)),
+              tilesX((width + kTileSize - 1) / kTileSize),
+              tilesY((height + kTileSize - 1) / kTileSize) {}
+
+        size_t pixel(int x, int y) const { return static_cast<size_t>(y) * width + x; }
+
+        /// Camera ray through the point `film` of the image, in pixels.
+        Ray ray(const glm::dvec2& film) const {
+            return Ray(plane.position, plane.direction(film.x, film.y));
+        }
+
+        int width;
+        int height;
+        ImagePlane plane;
+        int tilesX;
+        int tilesY;
+    };
+
+    /// Calls `renderTile(x0, y0, x1, y1)` for every tile of `frame`. Tiles are handed out to the
+    /// threads by a work-stealing scheduler. Every thread keeps its scratch state on its own
+    /// stack, and pixels show up as soon as they are done.
+    template <typename RenderTile>
+    void forEachTile(const Frame& frame, RenderTile renderTile) const {
+        TaskScheduler::run(frame.tilesX * frame.tilesY, _threads, [&](size_t tile, unsigned) {
+            int x0 = static_cast<int>(tile % frame.tilesX) * kTileSize;
+            int y0 = static_cast<int>(tile / frame.tilesX) * kTileSize;
+            renderTile(x0, y0, std::min(x0 + kTileSize, frame.width),
+                       std::min(y0 + kTileSize, frame.height));
+        });
+    }
+
+    /// Progressive rendering: every pass adds one jittered sample to each pixel that has not
+    /// converged yet and displays the running mean. Pixels only converge if `adaptive`, see
+    /// setAdaptiveThreshold(). The integrator provides
+    /// - `trace(sampler, film, x, y, rays)`, a sample of the radiance through the point `film` of
+    ///   pixel (x, y),
+    /// - `color(x, y, estimate, paths)`, the color shown for the pixel after `paths` samples
+    ///   over all pixels,
+    /// - `endPass(estimates, paths)`, which runs after every pass.
+    template <typename Trace, typename Color, typename EndPass>
+    void renderProgressive(const Frame& frame, bool adaptive, Trace trace, Color color,
+                           EndPass endPass) {
+        std::vector<PixelEstimate> estimates(static_cast<size_t>(frame.width) * frame.height);
+        // The sampler type is dispatched per pixel, so that the integrators are compiled for
+        // every pattern and draw their values without virtual calls.
+        auto traceSample = [&](auto sampler, int x, int y, int& rays) {
+            glm::dvec2 jitter = sampler.get2D();
+            return trace(sampler, glm::dvec2(x + jitter.x, y + jitter.y), x, y, rays);
+        };
+        auto samplePixel = [&](int x, int y, int index, int& rays) {
+            uint32_t ux = static_cast<uint32_t>(x), uy = static_cast<uint32_t>(y);
+            uint32_t i = static_cast<uint32_t>(index), n = static_cast<uint32_t>(_samples);
+            switch (_sampler) {
+            case SamplerType::Independent:
+                return traceSample(Sampler<sampling::Independent>(ux, uy, i, n), x, y, rays);
+            case SamplerType::Stratified:
+                return traceSample(Sampler<sampling::Stratified>(ux, uy, i, n), x, y, rays);
+            case SamplerType::Sobol:
+                return traceSample(Sampler<sampling::Sobol>(ux, uy, i, n), x, y, rays);
+            case SamplerType::BlueNoise:
+                break;
+            }
+            return traceSample(Sampler<sampling::BlueNoise>(ux, uy, i, n), x, y, rays);
+        };
+
+        std::atomic<bool> active(true);
+        std::atomic<uint64_t> rays(0), paths(0);
+        for (int pass = 0; pass < _samples && running() && active; ++pass) {
+            active = false;
+            forEachTile(frame, [&](int x0, int y0, int x1, int y1) {
+                bool tileActive = false;
+                int tileRays = 0, tilePaths = 0;
+                for (int y = y0; y < y1 && running(); ++y) {
+                    for (int x = x0; x < x1 && running(); ++x) {
+                        PixelEstimate& estimate = estimates[frame.pixel(x, y)];
+                        if (estimate.converged) continue;
+
+                        estimate.add(samplePixel(x, y, estimate.count, tileRays));
+                        ++tilePaths;
+                        estimate.converged = adaptive && _adaptiveThreshold > 0 &&
+                                             estimate.count >= kMinAdaptiveSamples &&
+                                             estimate.relativeError() < _adaptiveThreshold;
+                        tileActive |= !estimate.converged;
+                        _image->setPixel(x, y, color(x, y, estimate, paths.load()));
+                        _heatmap->setPixel(x, y, heat(double(estimate.count) / _samples));
+                    }
+                }
+                if (tileActive) active = true;
+                rays += tileRays;
+                paths += tilePaths;
+            });
+            endPass(static_cast<const std::vector<PixelEstimate>&>(estimates), paths.load());
+        }
+        _raysPerSample = paths > 0 ? double(rays) / paths : 0;
+    }
+
+    /// Path tracing, with the irradiance and radiance caches if they are enabled.
+    void renderPaths(const Frame& frame) {
+        // The caches are filled while rendering.
+        _pixelSize = 2 * frame.plane.halfHeight / frame.height;
+        if (_irradianceAccuracy > 0) {
+            BoundingBox bounds(_sceneCenter - _sceneRadius, _sceneCenter + _sceneRadius);
+            _irradianceCache = std::make_shared<IrradianceCache>(bounds, _irradianceAccuracy);
+        }
+        if (_radianceCacheBounces > 0) {
+            _radianceCache = std::make_shared<RadianceCache>(size_t(kRadianceCacheCells));
+        }
+        renderProgressive(
+            frame, true,
+            [&](auto& sampler, const glm::dvec2& film, int, int, int& rays) {
+                return radiance(frame.ray(film), sampler, rays);
+            },
+            [](int, int, const PixelEstimate& estimate, uint64_t) { return estimate.mean(); },
+            [&](const std::vector<PixelEstimate>&, uint64_t) {
+                // Paths of the next pass end at the light that this one added to the cache.
+                if (_radianceCacheBounces > 0) _radianceCache->decay(_threads);
+            });
+    }
+
+    /// Bidirectional path tracing. Light paths add to the pixels they are seen in. Every sample
+    /// traces one light path, so the splats of a pixel are averaged over all samples.
+    void renderBidirectional(const Frame& frame) {
+        SplatBuffer splats(frame.width, frame.height);
+        auto color = [&](int x, int y, const PixelEstimate& estimate, uint64_t paths) {
+            if (paths == 0) return estimate.mean();
+            return estimate.mean() +
+                   splats.get(x, y) * (double(frame.width) * frame.height / double(paths));
+        };
+        renderProgressive(
+            frame, true,
+            [&](auto& sampler, const glm::dvec2& film, int, int, int& rays) {
+                return bidirectional(frame.plane, film, sampler, splats, rays);
+            },
+            color,
+            [&](const std::vector<PixelEstimate>& estimates, uint64_t paths) {
+                // Splats also reach pixels of tiles that were rendered before them.
+                forEachTile(frame, [&](int x0, int y0, int x1, int y1) {
+                    for (int y = y0; y < y1; ++y) {
+                        for (int x = x0; x < x1; ++x) {
+                            const PixelEstimate& estimate = estimates[frame.pixel(x, y)];
+                            _image->setPixel(x, y, color(x, y, estimate, paths));
+                        }
+                    }
+                });
+            });
+    }
+
+    /// Photon mapping: traces the global and the caustic photon map, then camera paths that
+    /// read them.
+    void renderPhotonMap(const Frame& frame) {
+        _globalMap = tracePhotons(_photonCount, false);
+        _causticMap = tracePhotons(_causticPhotonCount, true);
+        renderProgressive(
+            frame, true,
+            [&](auto& sampler, const glm::dvec2& film, int, int, int& rays) {
+                return photonRadiance(frame.ray(film), sampler, rays);
+            },
+            [](int, int, const PixelEstimate& estimate, uint64_t) { return estimate.mean(); },
+            [](const std::vector<PixelEstimate>&, uint64_t) {});
+    }
+
+    /// Stochastic progressive photon mapping. The estimates hold the light sampled directly at the
+    /// visible points, the photon pass after every camera pass adds the rest to the flux of the
+    /// pixels.
+    void renderProgressivePhotons(const Frame& frame) {
+        std::vector<ProgressivePixel> pixels(static_cast<size_t>(frame.width) * frame.height);
+        for (ProgressivePixel& pixel : pixels) pixel.radius = kProgressiveRadius * _sceneRadius;
+        SplatBuffer flux(frame.width, frame.height);
+        VisiblePointGrid grid;
+        int photonPasses = 0;
+        auto color = [&](int x, int y, const PixelEstimate& estimate, uint64_t) {
+            return estimate.mean() + pixels[frame.pixel(x, y)].radiance(photonPasses);
+        };
+        // Visible points are needed in every pass, so pixels do not converge.
+        renderProgressive(
+            frame, false,
+            [&](auto& sampler, const glm::dvec2& film, int x, int y, int& rays) {
+                return visiblePoint(frame.ray(film), sampler, rays, pixels[frame.pixel(x, y)]);
+            },
+            color,
+            [&](const std::vector<PixelEstimate>& estimates, uint64_t) {
+                if (running()) {
+                    grid.build(pixels);
+                    int photons = _passPhotons > 0 ? _passPhotons : frame.width * frame.height;
+                    flux.clear();
+                    traceProgressivePhotons(photons, photonPasses, pixels, grid, frame.width, flux);
+                    ++photonPasses;
+                    _progressiveMemory =
+                        grid.memoryUsage() + pixels.size() * sizeof(ProgressivePixel);
+                }
+                // Photons also reach pixels of tiles that were rendered before them.
+                forEachTile(frame, [&](int x0, int y0, int x1, int y1) {
+                    for (int y = y0; y < y1; ++y) {
+                        for (int x = x0; x < x1; ++x) {
+                            size_t i = frame.pixel(x, y);
+                            pixels[i].update(flux.get(x, y));
+                            _image->setPixel(x, y, color(x, y, estimates[i], 0));
+                        }
+                    }
+                });
+            });
+    }
+
+    /// Whitted ray tracing with one ray per pixel, traced in packets if setPacketSize() asks for
+    /// it.
+    void renderWhitted(const Frame& frame) {
+        auto direction = [&](double x, double y) { return frame.plane.direction(x, y); };
+        std::atomic<uint64_t> rays(0);
+        forEachTile(frame, [&](int x0, int y0, int x1, int y1) {
+            int tileRays = 0;
+            if (_packetSize > 1) {
+                RayPacket packet(_camera.pos);
+                for (int by = y0; by < y1 && running(); by += _packetSize) {
+                    for (int bx = x0; bx < x1 && running(); bx += _packetSize) {
+                        int bx1 = std::min(bx + _packetSize, x1) - 1;
+                        int by1 = std::min(by + _packetSize, y1) - 1;
+                        packet.reset({direction(bx, by), direction(bx1, by), direction(bx1, by1),
+                                      direction(bx, by1)});
+                        for (int y = by; y <= by1; ++y) {
+                            for (int x = bx; x <= bx1; ++x) packet.push_back(direction(x, y));
+                        }
+
+                        _scene->intersect(packet, isEmitter);
+                        for (int i = 0; i < packet.size; ++i) {
+                            glm::dvec3 pixelColor =
+                                traceRay(packet.rays[i], packet.hits[i], tileRays);
+                            _image->setPixel(bx + i % (bx1 - bx + 1), by + i / (bx1 - bx + 1),
+                                             pixelColor);
+                        }
+                    }
+                }
+                rays += tileRays;
+                return;
+            }
+
+            // The structure of the for loop should remain for incremental rendering.
+            for (int y = y0; y < y1 && running(); ++y) {
+                for (int x = x0; x < x1 && running(); ++x) {
+                    Ray ray(_camera.pos, direction(x, y));
+                    glm::dvec3 pixelColor = traceRay(ray, tileRays);
+                    _image->setPixel(x, y, pixelColor);
+                }
+            }
+            rays += tileRays;
+        });
+        double pixels = static_cast<double>(frame.width) * frame.height;
+        _raysPerSample = pixels > 0 ? double(rays) / pixels : 0;
+    }
+
+    /// Samples every pixel gets before adaptive sampling may consider it converged.
+    static constexpr int kMinAdaptiveSamples = 16;
+    /// Side of the square tiles the image is split into for rendering.
+    static constexpr int kTileSize = 32;
+    /// Largest block whose rays fit into a RayPacket.
+    static constexpr int kMaxPacketSize = 8;
+    /// Weight below which the Whitted integrator skips secondary rays by default. Even rays with
+    /// a radiance of a few times white change no 8-bit color channel below it.
+    static constexpr double kDefaultPruneThreshold = 1e-3;
+    /// Default of setLightCut(). Clusters this small are lit almost the same from all their points.
+    static constexpr double kDefaultLightCut = 0.1;
+    /// Paths end after this many bounces.
+    static constexpr int kMaxBounces = 5;
+    /// Paths may end by Russian roulette from this bounce on.
+    static constexpr int kRouletteBounce = 2;
+    /// Number of bounces at which paths may split at most.
+    static constexpr int kMaxSplitBounces = 4;
+    /// Vertices of the longest subpaths of bidirectional path tracing: the camera or emitter
+    /// vertex, one per bounce, and the vertex that ends the path.
+    static constexpr int kMaxSubpathVertices = kMaxBounces + 2;
+    /// First sampler vertices of light subpaths and of the emitter samples of connections, after
+    /// those of camera subpaths.
+    static constexpr int kLightSamplerVertex = kMaxSubpathVertices;
+    static constexpr int kConnectionSamplerVertex = 2 * kMaxSubpathVertices;
+
+    using Subpath = std::array<PathVertex, kMaxSubpathVertices>;
+
+    /// Photons whose power density the photon mapper estimates at a point, and the largest
+    /// radius it searches them in, relative to the radius of the scene. Final gathering averages
+    /// many estimates, so it makes do with fewer photons each.
+    static constexpr int kGlobalNearest = 64;
+    static constexpr int kGatherNearest = 16;
+    static constexpr double kGlobalRadius = 0.1;
+    static constexpr int kCausticNearest = 32;
+    static constexpr double kCausticRadius = 0.02;
+    /// Photons traced by one task of the emission pass.
+    static constexpr size_t kPhotonBatch = 4096;
+    /// Radius within which progressive photon mapping starts to gather photons, relative to the
+    /// radius of the scene.
+    static constexpr double kProgressiveRadius = 0.05;
+    /// Largest radius of irradiance records, relative to the radius of the scene.
+    static constexpr double kMaxIrradianceRadius = 0.25;
+    /// Pixels that an irradiance record covers at least, so that records are not computed for
+    /// details the image cannot show, e.g. in corners.
+    static constexpr double kMinRecordPixels = 4;
+    /// Cells of the radiance cache, 56 bytes each.
+    static constexpr size_t kRadianceCacheCells = size_t(1) << 18;
+    /// Pixels that a cell of the radiance cache spans at least, at its distance from the camera.
+    static constexpr double kRadianceCellPixels = 8;
+    /// First sampler vertex of final gather rays, after those of the camera path. Every gather
+    /// ray uses the vertices of a subpath.
+    static constexpr int kGatherSamplerVertex = kMaxSubpathVertices;
+
+    /// Emissive entities are lights of the path tracer, which the Whitted integrator does not see.
+    static bool isEmitter(const Entity* e) { return e->material->isEmissive(); }
+
+    /// Random bits that depend on the exact position of a point.
+    static uint64_t pointKey(const glm::dvec3& point) {
+        uint64_t key = 0;
+        for (int i = 0; i < 3; ++i) {
+            uint64_t bits;
+            std::memcpy(&bits, &point[i], sizeof(bits));
+            key = hash64(key ^ bits);
+        }
+        return key;
+    }
+
+    /// Multiple importance sampling weight of a sample that one strategy took with density `pdf`
+    /// and the other one would have taken with density `other`.
+    double misWeight(double pdf, double other) const {
+        if (_mis == Mis::Power) {
+            pdf *= pdf;
+            other *= other;
+        }
+        return pdf / (pdf + other);
+    }
+
+    /// State of a path between two bounces.
+    struct PathState {
+        Ray ray;
+        glm::dvec3 throughput;
+        int bounce;
+        /// Solid angle density with which the ray was sampled at a diffuse vertex, or 0 for camera
+        /// rays and specular bounces, whose emission is counted fully as no light sampling could
+        /// have found it.
+        double bsdfPdf;
+        /// Normal at the vertex the ray leaves from, if it was sampled at a diffuse vertex.
+        glm::dvec3 normal = glm::dvec3(0);
+        /// Leaves out the emission the ray hits, as the light at its origin is sampled otherwise.
+        bool skipEmission = false;
+    };
+
+    /// Diffuse vertex of a path that adds to the radiance cache: its cell, the throughput of the
+    /// path up to it and the result of the path before it.
+    struct RadianceVertex {
+        uint64_t cell;
+        glm::dvec3 throughput;
+        glm::dvec3 result;
+    };
+
+    /// Estimates the radiance along a primary ray with one path, or a few paths if it splits at
+    /// a dielectric during the first bounces. Adds the number of rays it traced to `rays`.
+    template <typename Pattern>
+    glm::dvec3 radiance(const Ray& primary, Sampler<Pattern>& sampler, int& rays) {
+        return radiance(PathState{primary, glm::dvec3(1), 0, 0}, sampler, rays,
+                        _irradianceAccuracy > 0);
+    }
+
+    /// Estimates the light that `path` and the branches it splits into carry back to its origin.
+    /// If `cached`, paths take the indirect light at diffuse surfaces they reach through specular
+    /// ones from the irradiance cache. Paths add to the radiance cache and end at it, if it is
+    /// enabled. Stores the distance to the first hit of the path in
+    /// `distance`, if given, or infinity if it hits nothing.
+    template <typename Pattern>
+    glm::dvec3 radiance(PathState path, Sampler<Pattern>& sampler, int& rays, bool cached,
+                        double* distance = nullptr) {
+        // Branches of splits wait on a stack. Every split pushes one branch and continues with the
+        // other one bounce deeper, so the stack never holds more than one branch per bounce.
+        std::array<PathState, kMaxSplitBounces> pending;
+        int size = 0;
+        glm::dvec3 result(0);
+        // Diffuse vertices of the current branch, which get the light it adds to the result
+        // from them on in the radiance cache once the branch ends.
+        std::array<RadianceVertex, kMaxBounces> vertices;
+        int vertexCount = 0;
+
+        while (true) {
+            sampler.startVertex(path.bounce + 1);
+            ++rays;
+            Hit hit;
+            _scene->intersect(path.ray, hit);
+            glm::dvec3 intersectionPoint, normal;
+            Material material;
+            bool terminated = false;
+
+            bool found = resolveHit(path.ray, hit, intersectionPoint, normal, material);
+            if (distance) {
+                *distance = found ? hit.distance : INFINITY;
+                distance = nullptr;
+            }
+            if (!found) {
+                result += path.throughput * glm::dvec3(.9, .9, .9); // background color
+                terminated = true;
+            } else if (path.bounce >= kMaxBounces) {
+                terminated = true;
+            } else {
+                uint64_t cell = _radianceCacheBounces > 0
+                                    ? radianceCell(path.ray, intersectionPoint, normal, material)
+                                    : 0;
+                glm::dvec3 cachedRadiance;
+                if (cell && path.bounce >= _radianceCacheBounces &&
+                    _radianceCache->lookup(cell, cachedRadiance)) {
+                    result += path.throughput * cachedRadiance;
+                    terminated = true;
+                } else {
+                    if (cell) vertices[vertexCount++] = {cell, path.throughput, result};
+                    int branches = size;
+                    terminated = !scatter(path, hit.entity, intersectionPoint, normal, material,
+                                          sampler, rays, cached, result, pending, size);
+                    // The branch split off here adds its light later, so the vertices would
+                    // miss it.
+                    if (size > branches) vertexCount = 0;
+                }
+            }
+
+            if (terminated) {
+                for (int i = 0; i < vertexCount; ++i) {
+                    const RadianceVertex& vertex = vertices[i];
+                    glm::dvec3 added = result - vertex.result, radiance(0);
+                    for (int c = 0; c < 3; ++c) {
+                        if (vertex.throughput[c] > 0) radiance[c] = added[c] / vertex.throughput[c];
+                    }
+                    _radianceCache->add(vertex.cell, radiance);
+                }
+                vertexCount = 0;
+                if (size == 0) break;
+                path = pending[--size];
+            }
         }
+        return result;
+    }
 
+    /// Key of the radiance cache cell at the point where `ray` hits a surface, or 0 if the
+    /// cache does not hold the light of the surface. Cells are sized by the pixels they cover at
+    /// their distance from the camera. Emitters are left out, as paths count their emission
+    /// themselves.
+    uint64_t radianceCell(const Ray& ray, const glm::dvec3& point, const glm::dvec3& normal,
+                          const Material& material) const {
+        if (material.materialType != MaterialType::Diffuse || material.isEmissive()) return 0;
+        glm::dvec3 orientedNormal = glm::dot(normal, ray.dir) < 0 ? normal : -normal;
+        double size = kRadianceCellPixels * _pixelSize * glm::length(point - _camera.pos);
+        return RadianceCache::key(point, orientedNormal, size);
+    }
+
+    /// Adds the emission and direct light at a path vertex to `result` and moves the path on to
+    /// its next vertex. Returns false if the path ends. See radiance() for `cached`.
+    template <typename Pattern>
+    bool scatter(PathState& path, const Entity* entity, const glm::dvec3& intersectionPoint,
+                 const glm::dvec3& normal, Material& material, Sampler<Pattern>& sampler,
+                 int& rays, bool cached, glm::dvec3& result,
+                 std::array<PathState, kMaxSplitBounces>& pending, int& size) {
+        const Ray& ray = path.ray;
         glm::dvec3 orientedNormal = (glm::dot(normal, ray.dir) < 0) ? normal : normal * -1.0;
 
-        // Russian Roulette; use maximum reflectivity amount
-        double p = (material.color.x > material.color.y && material.color.x > material.color.z) ? material.color.z : (material.color.y > material.color.z) ? material.color.y : material.color.z;
+        if (material.isEmissive() && !path.skipEmission) {
+            double weight = 1;
+            if (path.bsdfPdf > 0) {
+                double lightPdf = _emitters.probability(entity, ray.origin, path.normal) *
+                                  entity->directionPdf(ray.origin, intersectionPoint);
+                weight = lightPdf == 0          ? 1
+                         : _mis == Mis::None ? 0
+                                             : misWeight(path.bsdfPdf, lightPdf);
+            }
+            result += path.throughput * material.emission * weight;
+        }
 
-        if (++depth > 5 || !p) {
-            if (erand48(Xi) < p) {
+        // Russian Roulette; use maximum reflectivity amount
+        double p = std::max(material.color.x, std::max(material.color.y, material.color.z));
+        if (path.bounce >= kRouletteBounce || !p) {
+            if (sampler.get1D() < p) {
                 material.color = material.color * (1.0 / p);
             } else {
-                return material.emission * E;
+                return false;
             }
         }
 
         // Diffuse
         if (material.materialType == MaterialType::Diffuse) {
+            // Camera paths that use the irradiance cache end at the first diffuse surface they
+            // reach, and the cache gives the indirect light there.
+            if (cached && path.bsdfPdf == 0) {
+                // The last segment approximates the length of the path for its pixel footprint.
+                double footprint = glm::length(intersectionPoint - ray.origin) * _pixelSize;
+                glm::dvec3 irradiance =
+                    sampleLight(intersectionPoint, orientedNormal, sampler, false, rays) +
+                    cachedIrradiance(intersectionPoint, orientedNormal, footprint, rays);
+                result += path.throughput * material.color * (1.0 / M_PI) * irradiance;
+                return false;
+            }
+
             // Ideal Diffuse Reflection
-            double r1 = 2 * M_PI * erand48(Xi); // angle around
-            double r2 = erand48(Xi);
+            glm::dvec2 bounce = sampler.get2D();
+            double r1 = 2 * M_PI * bounce.x; // angle around
+            double r2 = bounce.y;
             double r2s = sqrt(r2); // distance from center
 
             glm::dvec3 w = orientedNormal;
@@ -238,40 +854,28 @@ class RayTracer {
             glm::dvec3 v = glm::cross(w, u); // v is perpendicular to u and w
             glm::dvec3 d = glm::normalize((u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2))); // d is random reflection ray
 
-            // loop over any lights
-            glm::dvec3 e;
-            for (auto& light : _scene->intersect(ray)) {
-                if (light->pos.x != 0) // light is a sphere and x coordinate is 0 to distinguish from other spheres
-                    continue; // Skip non-lights
-
-                // create random direction towards sphere using method from realistic ray tracing
-                glm::dvec3 sw = light->pos - intersectionPoint;
-                glm::dvec3 su = glm::normalize(glm::cross((fabs(sw.x) > 0.1 ? glm::dvec3(0, 1, 0) : glm::dvec3(1, 0, 0)), sw));
-                glm::dvec3 sv = glm::cross(sw, su);
-                double cos_a_max = sqrt(1 - pow(light->radius, 2) / glm::dot((intersectionPoint - light->pos), (intersectionPoint - light->pos)));
-
-                double eps1 = erand48(Xi);
-                double eps2 = erand48(Xi);
-                double cos_a = 1 - eps1 + eps1 * cos_a_max;
-                double sin_a = sqrt(1 - cos_a * cos_a);
-                double phi = 2 * 3.14159265358979 * eps2;
-                glm::dvec3 l = glm::normalize(su * cos(phi) * sin_a + sv * sin(phi) * sin_a + sw * cos_a);
-
-                // shoot shadow rays
-                Material tmpMaterial;
-                if (intersect(Ray(intersectionPoint, l), glm::dvec3(), glm::dvec3(), tmpMaterial)) {
-                    double omega = 2 * M_PI * (1 - cos_a_max);
-                    e = e + (material.color * light->material.emission * glm::dot(l, orientedNormal) * omega) * (1.0 / M_PI); // 1/pi fpr brdf
-                }
-            }
+            // Next event estimation
+            result += path.throughput * material.color * (1.0 / M_PI) *
+                      sampleLight(intersectionPoint, orientedNormal, sampler, true, rays);
 
-            return material.emission * E + e + (material.color * radiance(Ray(intersectionPoint, d), depth, Xi, 0));
-        } else if (material.materialType == MaterialType::Specular) {
-            return material.emission + (material.color * radiance(Ray(intersectionPoint, (ray.dir - normal * 2.0 * glm::dot(normal, ray.dir))), depth, Xi));
+            // Offset like shadow rays, so that the bounce cannot hit the same surface again.
+            glm::dvec3 origin = intersectionPoint + orientedNormal * 1e-3;
+            path = {Ray(origin, d), path.throughput * material.color, path.bounce + 1,
+                    glm::dot(d, orientedNormal) / M_PI, orientedNormal};
+            return true;
         }
-        // OTHERWISE WE HAVE A DIELECTRIC(GLASS) SURFACE
-        Ray reflRay( intersectionPoint, (ray.dir - normal * 2.0 * glm::dot(normal, ray.dir))); // Ideal dielectric reflection
 
+        // Like bounce rays, reflected and refracted rays start off the surface on their side, or
+        // they may hit it again at once.
+        Ray reflRay(intersectionPoint + orientedNormal * 1e-3, (ray.dir - normal * 2.0 * glm::dot(normal, ray.dir))); // Ideal (dielectric) reflection
+        glm::dvec3 throughput = path.throughput * material.color;
+        int bounce = path.bounce + 1;
+
+        if (material.materialType == MaterialType::Specular) {
+            path = {reflRay, throughput, bounce, 0};
+            return true;
+        }
+        // OTHERWISE WE HAVE A DIELECTRIC(GLASS) SURFACE
         bool into = glm::dot(normal, orientedNormal) > 0; // ray from outside going in?
         double nc = 1;
         double nt = 1.5;
@@ -280,33 +884,838 @@ class RayTracer {
         double cos2t;
         // if total internal reflection, REFLECT
         if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) { // total internal reflection
-            return material.emission + (material.color * radiance(reflRay, depth, Xi));
+            path = {reflRay, throughput, bounce, 0};
+            return true;
         }
         // otherwise, choose REFLECTION or REFRACTION
         glm::dvec3 tdir = glm::normalize((ray.dir * nnt - normal * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))));
+        Ray refrRay(intersectionPoint - orientedNormal * 1e-3, tdir);
         double a = nt - nc;
         double b = nt + nc;
         double R0 = a * a / (b * b);
         double c = 1 - (into ? -ddn : glm::dot(tdir, normal));
         double Re = R0 + (1 - R0) * c * c * c * c * c;
         double Tr = 1 - Re;
+
+        // Split into both rays during the first bounces, choose one of them later on
+        if (path.bounce < _splitBounces && size < kMaxSplitBounces) {
+            pending[size++] = {refrRay, throughput * Tr, bounce, 0};
+            path = {reflRay, throughput * Re, bounce, 0};
+            return true;
+        }
         double P = .25 + .5 * Re;
         double RP = Re / P;
         double TP = Tr / (1 - P);
-        return material.emission + material.color * (depth > 2 ? (erand48(Xi) < P ? radiance(reflRay, depth, Xi) * RP : radiance(Ray(intersectionPoint, tdir), depth, Xi) * TP) : radiance(reflRay, depth, Xi) * Re + radiance(Ray(intersectionPoint, tdir), depth, Xi) * Tr);
+        if (sampler.get1D() < P) {
+            path = {reflRay, throughput * RP, bounce, 0};
+        } else {
+            path = {refrRay, throughput * TP, bounce, 0};
+        }
+        return true;
     }
 
-    bool running() const { return _running; }
-    void stop() { _running = false; }
-    void start() { _running = true; }
+    /// Estimates the irradiance of a diffuse surface at `point`, facing the incoming ray with
+    /// `orientedNormal`, from one direction sampled towards a light. The light is selected by
+    /// importance at the origin of the shadow ray. If `weighted`, the sample is weighted against
+    /// bounce rays that hit the light, see setMis().
+    template <typename Pattern>
+    glm::dvec3 sampleLight(const glm::dvec3& point, const glm::dvec3& orientedNormal,
+                           Sampler<Pattern>& sampler, bool weighted, int& rays) {
+        if (_emitters.empty()) return glm::dvec3(0);
+        glm::dvec3 origin = point + orientedNormal * 1e-3;
+        double selection, pdf;
+        Entity* light = _emitters.select(origin, orientedNormal, sampler.get1D(), selection);
+        glm::dvec2 eps = sampler.get2D();
+        glm::dvec3 l;
+        if (!light || !light->sampleDirection(point, eps, l, pdf) ||
+            glm::dot(l, orientedNormal) <= 0) {
+            return glm::dvec3(0);
+        }
+        // shoot shadow rays; the light is visible if nothing lies in front of it
+        Ray shadowRay(origin, l);
+        double lightDistance;
+        ++rays;
+        if (!light->intersect(shadowRay, lightDistance) ||
+            occluded(shadowRay, lightDistance * (1 - 1e-6))) {
+            return glm::dvec3(0);
+        }
+        double cosine = glm::dot(l, orientedNormal);
+        double lightPdf = pdf * selection;
+        double weight = !weighted || _mis == Mis::None ? 1 : misWeight(lightPdf, cosine / M_PI);
+        return light->material->emission * cosine * weight / lightPdf;
+    }
 
-    std::shared_ptr<Image> getImage() const { return _image; }
+    /// Indirect irradiance at `point` on a diffuse surface with `normal`, interpolated from the
+    /// irradiance cache, or from a new record if the cache has none close enough. `footprint` is
+    /// the size of a pixel at the point; records cover at least a few pixels.
+    glm::dvec3 cachedIrradiance(const glm::dvec3& point, const glm::dvec3& normal,
+                                double footprint, int& rays) {
+        glm::dvec3 irradiance;
+        if (_irradianceCache->interpolate(point, normal, irradiance)) return irradiance;
+        double minRadius = kMinRecordPixels * footprint / _irradianceAccuracy;
+        IrradianceRecord record = irradianceRecord(point, normal, minRadius, rays);
+        _irradianceCache->insert(record);
+        return record.irradiance;
+    }
 
-  private:
-    bool _running = false;
-    const Octree* _scene;
+    /// Samples the indirect irradiance at `point` on a diffuse surface with `normal` with paths
+    /// through M x N strata of the cosine distributed hemisphere, M in the polar and N in the
+    /// azimuthal angle, and estimates its gradients from the differences between neighboring
+    /// strata [Ward and Heckbert 1992]. Light straight from the emitters is left out, it is
+    /// sampled directly at every shading point. The radius of the record is at least `minRadius`.
+    IrradianceRecord irradianceRecord(const glm::dvec3& point, const glm::dvec3& normal,
+                                      double minRadius, int& rays) {
+        int thetas = std::max(1, static_cast<int>(std::lround(std::sqrt(_irradianceRays / M_PI))));
+        int phis = std::max(1, _irradianceRays / thetas);
+        uint32_t count = static_cast<uint32_t>(thetas * phis);
+        uint64_t key = pointKey(point);
+
+        glm::dvec3 u = glm::normalize(glm::cross(
+            std::fabs(normal.x) > .1 ? glm::dvec3(0, 1, 0) : glm::dvec3(1, 0, 0), normal));
+        glm::dvec3 v = glm::cross(normal, u);
+        glm::dvec3 origin = point + normal * 1e-3;
+
+        IrradianceRecord record;
+        record.point = point;
+        record.normal = normal;
+        std::vector<glm::dvec3> radiances(count);
+        std::vector<double> distances(count);
+        double inverseDistances = 0;
+        for (int j = 0; j < thetas; ++j) {
+            // Tangent of the polar angle at the center of the ring
+            double sin2 = (j + 0.5) / thetas;
+            double tangent = std::sqrt(sin2 / (1 - sin2));
+            for (int k = 0; k < phis; ++k) {
+                uint32_t index = static_cast<uint32_t>(j * phis + k);
+                Sampler<sampling::Sobol> sampler(static_cast<uint32_t>(key),
+                                                 static_cast<uint32_t>(key >> 32), index, count);
+                sampler.startVertex(0);
+                glm::dvec2 jitter = sampler.get2D();
+                double sinTheta = std::sqrt((j + jitter.x) / thetas);
+                double cosTheta = std::sqrt(std::max(0.0, 1 - sinTheta * sinTheta));
+                double phi = 2 * M_PI * (k + jitter.y) / phis;
+                glm::dvec3 dir =
+                    (u * std::cos(phi) + v * std::sin(phi)) * sinTheta + normal * cosTheta;
+
+                PathState path{Ray(origin, dir), glm::dvec3(1), 1, cosTheta / M_PI, normal, true};
+                glm::dvec3 incoming = radiance(path, sampler, rays, false, &distances[index]);
+                radiances[index] = incoming;
+                record.irradiance += incoming;
+                inverseDistances += 1 / distances[index];
+                // Turning the normal towards the direction about the normal times this axis
+                // raises the cosine of the sample by the tangent.
+                glm::dvec3 axis = v * std::cos(phi) - u * std::sin(phi);
+                record.rotationalGradient += glm::outerProduct(axis, tangent * incoming);
+            }
+        }
+        double scale = M_PI / count;
+        record.irradiance *= scale;
+        record.rotationalGradient *= scale;
+
+        // Moving the point shifts the walls between strata, which changes their solid angles.
+        // The shift depends on the distance of the surfaces seen through the wall.
+        for (int k = 0; k < phis; ++k) {
+            double phi = 2 * M_PI * (k + 0.5) / phis;
+            double wallPhi = 2 * M_PI * k / phis;
+            glm::dvec3 radial = u * std::cos(phi) + v * std::sin(phi);
+            glm::dvec3 wallNormal = v * std::cos(wallPhi) - u * std::sin(wallPhi);
+            int previousK = (k + phis - 1) % phis;
+            for (int j = 0; j < thetas; ++j) {
+                int i = j * phis + k;
+                double sinLower = std::sqrt(double(j) / thetas);
+                double sinUpper = std::sqrt(double(j + 1) / thetas);
+                if (j > 0) {
+                    int below = i - phis;
+                    double cos2 = 1 - double(j) / thetas;
+                    double weight = 2 * M_PI / phis * sinLower * cos2 /
+                                    std::min(distances[i], distances[below]);
+                    record.translationalGradient += glm::outerProduct(
+                        radial, weight * (radiances[i] - radiances[below]));
+                }
+                int side = j * phis + previousK;
+                double weight = (sinUpper - sinLower) / std::min(distances[i], distances[side]);
+                record.translationalGradient +=
+                    glm::outerProduct(wallNormal, weight * (radiances[i] - radiances[side]));
+            }
+        }
+
+        // Records are valid for the harmonic mean distance of the surroundings, but no further
+        // than the gradient takes the irradiance to 0.
+        double radius = inverseDistances > 0 ? count / inverseDistances : INFINITY;
+        glm::dvec3 luminanceGradient =
+            record.translationalGradient * glm::dvec3(0.2126, 0.7152, 0.0722);
+        double slope = glm::length(luminanceGradient);
+        if (slope > 0) radius = std::min(radius, luminance(record.irradiance) / slope);
+        record.radius = glm::clamp(radius, minRadius, kMaxIrradianceRadius * _sceneRadius);
+        // Where the radius had to grow, e.g. in corners, the gradient is flattened, so that it
+        // does not take any channel below 0 within the radius.
+        for (int c = 0; c < 3; ++c) {
+            double change = glm::length(record.translationalGradient[c]) * record.radius;
+            if (change > record.irradiance[c]) {
+                record.translationalGradient[c] *= record.irradiance[c] / change;
+            }
+        }
+        return record;
+    }
+
+    /// Estimates the radiance through the image point `film` with bidirectional path tracing
+    /// [Veach 1997]: a camera and a light subpath are connected in every possible way, and the
+    /// connections are weighted by multiple importance sampling. Connections of the light subpath
+    /// to the camera are seen in other pixels and go to `splats`. Adds the number of rays it traced
+    /// to `rays`.
+    template <typename Pattern>
+    glm::dvec3 bidirectional(const ImagePlane& plane, const glm::dvec2& film,
+                             Sampler<Pattern>& sampler, SplatBuffer& splats, int& rays) {
+        // Both subpaths live on the stack of the rendering thread, an arena of fixed size that is
+        // reused for every sample without allocations.
+        Subpath cameraPath, lightPath;
+        glm::dvec3 result(0);
+        cameraPath[0] = PathVertex::camera(plane.position, plane.forward);
+        Ray primary(plane.position, plane.direction(film.x, film.y));
+        int cameraVertices = 1 + randomWalk(primary, glm::dvec3(1), plane.directionPdf(primary.dir),
+                                            0, sampler, cameraPath, &result, rays);
+        int lightVertices = lightSubpath(sampler, lightPath, rays);
+
+        for (int t = 1; t <= cameraVertices; ++t) {
+            for (int s = 0; s <= lightVertices; ++s) {
+                int depth = s + t - 2;
+                if ((s == 1 && t == 1) || depth < 0 || depth > kMaxBounces) continue;
+                glm::dvec2 pixel;
+                glm::dvec3 contribution =
+                    connect(plane, lightPath, s, cameraPath, t, sampler, pixel, rays);
+                if (t > 1) {
+                    result += contribution;
+                } else if (contribution != glm::dvec3(0)) {
+                    splats.add(pixel, contribution);
+                }
+            }
+        }
+        return result;
+    }
+
+    /// Starts a light subpath on an emitter selected by power and extends it. Returns its number
+    /// of vertices.
+    template <typename Pattern>
+    int lightSubpath(Sampler<Pattern>& sampler, Subpath& path, int& rays) {
+        if (_emitters.empty()) return 0;
+        sampler.startVertex(kLightSamplerVertex);
+        PathVertex& origin = path[0];
+        if (!sampleEmitter(sampler, origin)) return 0;
+
+        // Emitters are seen from both sides, so they emit into both hemispheres.
+        glm::dvec2 u = sampler.get2D();
+        glm::dvec3 normal = u.x < 0.5 ? origin.normal : -origin.normal;
+        u.x = u.x < 0.5 ? 2 * u.x : 2 * u.x - 1;
+        glm::dvec3 dir = cosineDirection(normal, u);
+        double pdf = emissionPdf(origin, dir);
+        if (pdf <= 0) return 1;
+        glm::dvec3 throughput = origin.throughput * glm::dot(dir, normal) / pdf;
+        return 1 + randomWalk(Ray(origin.point + normal * 1e-3, dir), throughput, pdf,
+                              kLightSamplerVertex, sampler, path, nullptr, rays);
+    }
+
+    /// Samples a point on an emitter selected by power as the first vertex of a light subpath.
+    template <typename Pattern>
+    bool sampleEmitter(Sampler<Pattern>& sampler, PathVertex& vertex) {
+        double selection;
+        Entity* light = _emitters.selectByPower(sampler.get1D(), selection);
+        glm::dvec3 point, normal;
+        if (!light->samplePoint(sampler.get2D(), point, normal)) return false;
+        double pdf = selection / light->area();
+        vertex = PathVertex::light(light, point, normal, light->material->emission / pdf);
+        vertex.pdfFwd = pdf;
+        return true;
+    }
+
+    /// Extends a subpath from its last vertex path[0] along `ray`, which was sampled with solid
+    /// angle density `pdf`. Camera subpaths pass `background`, to which the light of rays that
+    /// leave the scene is added. Returns the number of vertices added.
+    template <typename Pattern>
+    int randomWalk(Ray ray, glm::dvec3 throughput, double pdf, int samplerVertex,
+                   Sampler<Pattern>& sampler, Subpath& path, glm::dvec3* background, int& rays) {
+        int count = 1;
+        while (count < kMaxSubpathVertices) {
+            sampler.startVertex(samplerVertex + count);
+            ++rays;
+            Hit hit;
+            _scene->intersect(ray, hit);
+            glm::dvec3 point, normal;
+            Material material;
+            if (!resolveHit(ray, hit, point, normal, material)) {
+                if (background) *background += throughput * glm::dvec3(.9, .9, .9);
+                break;
+            }
+            PathVertex& previous = path[count - 1];
+            PathVertex& vertex = path[count++];
+            vertex = PathVertex::surface(hit.entity, point, normal, material, throughput);
+            vertex.pdfFwd = previous.toArea(pdf, vertex);
+            if (count == kMaxSubpathVertices) break;
+
+            glm::dvec3 wo = -ray.dir, wi, weight;
+            double pdfRev;
+            if (!sampleBsdf(vertex, wo, sampler, wi, pdf, pdfRev, weight)) break;
+            throughput *= weight;
+            // Russian roulette, as in scatter()
+            double p = std::max(weight.x, std::max(weight.y, weight.z));
+            if (count - 2 >= kRouletteBounce || !p) {
+                if (sampler.get1D() >= p) break;
+                throughput *= 1 / p;
+            }
+            previous.pdfRev = vertex.toArea(pdfRev, previous);
+            ray = Ray(point + normal * (glm::dot(wi, normal) > 0 ? 1e-3 : -1e-3), wi);
+        }
+        return count - 1;
+    }
+
+    /// Samples the direction `wi` in which light leaves a surface vertex seen from `wo`, with the
+    /// same materials as scatter(). Returns the solid angle densities of sampling wi from wo and
+    /// wo from wi, which are 0 for specular directions, and the ratio of the scattered light
+    /// and its density in `weight`.
+    template <typename Pattern>
+    static bool sampleBsdf(const PathVertex& vertex, const glm::dvec3& wo,
+                           Sampler<Pattern>& sampler, glm::dvec3& wi, double& pdf,
+                           double& pdfRev, glm::dvec3& weight) {
+        glm::dvec3 normal = vertex.normal;
+        glm::dvec3 orientedNormal = glm::dot(wo, normal) > 0 ? normal : -normal;
+        weight = vertex.color;
+        if (vertex.materialType == MaterialType::Diffuse) {
+            wi = cosineDirection(orientedNormal, sampler.get2D());
+            pdf = glm::dot(wi, orientedNormal) / glm::pi<double>();
+            pdfRev = glm::dot(wo, orientedNormal) / glm::pi<double>();
+            return pdf > 0;
+        }
+
+        pdf = pdfRev = 0;
+        glm::dvec3 reflected = normal * 2.0 * glm::dot(normal, wo) - wo;
+        if (vertex.materialType == MaterialType::Specular) {
+            wi = reflected;
+            return true;
+        }
+        // Dielectric, reflecting or refracting with the probability of the Fresnel term
+        glm::dvec3 dir = -wo;
+        bool into = glm::dot(normal, orientedNormal) > 0;
+        double nc = 1;
+        double nt = 1.5;
+        double nnt = into ? nc / nt : nt / nc;
+        double ddn = glm::dot(dir, orientedNormal);
+        double cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+        if (cos2t < 0) {
+            wi = reflected;
+            return true;
+        }
+        glm::dvec3 tdir = glm::normalize(
+            (dir * nnt - normal * ((into ? 1 : -1) * (ddn * nnt + std::sqrt(cos2t)))));
+        double a = nt - nc;
+        double b = nt + nc;
+        double R0 = a * a / (b * b);
+        double c = 1 - (into ? -ddn : glm::dot(tdir, normal));
+        double Re = R0 + (1 - R0) * c * c * c * c * c;
+        wi = sampler.get1D() < Re ? reflected : tdir;
+        return true;
+    }
+
+    /// Contribution of the path made of the first `s` vertices of the light subpath and the first
+    /// `t` vertices of the camera subpath, weighted by multiple importance sampling. Connections to
+    /// the camera return the image position they are seen at in `pixel`.
+    template <typename Pattern>
+    glm::dvec3 connect(const ImagePlane& plane, const Subpath& lightPath, int s,
+                       const Subpath& cameraPath, int t, Sampler<Pattern>& sampler,
+                       glm::dvec2& pixel, int& rays) {
+        const PathVertex& pt = cameraPath[t - 1];
+        PathVertex sampled;
+        const PathVertex* qs = s == 1 ? &sampled : s > 1 ? &lightPath[s - 1] : nullptr;
+        glm::dvec3 contribution(0);
+        if (s == 0) {
+            // The camera subpath hit an emitter by itself
+            if (!pt.isEmissive()) return contribution;
+            contribution = pt.throughput * pt.emission;
+        } else if (t == 1) {
+            // Light tracing: the camera sees the end of the light subpath
+            if (qs->delta || !plane.project(qs->point, pixel)) return contribution;
+            glm::dvec3 d = plane.position - qs->point;
+            glm::dvec3 toCamera = glm::normalize(d);
+            contribution = qs->throughput * qs->f(direction(*qs, lightPath[s - 2]), toCamera) *
+                           plane.importance(-toCamera) * geometry(*qs, pt);
+        } else if (s == 1) {
+            // Light sampling: the camera subpath is connected to a new point on an emitter
+            if (pt.delta) return contribution;
+            sampler.startVertex(kConnectionSamplerVertex + t);
+            if (!sampleEmitter(sampler, sampled)) return contribution;
+            contribution = pt.throughput *
+                           pt.f(direction(pt, cameraPath[t - 2]), direction(pt, sampled)) *
+                           geometry(pt, sampled) * sampled.throughput;
+        } else {
+            if (pt.delta || qs->delta) return contribution;
+            contribution = qs->throughput *
+                           qs->f(direction(*qs, lightPath[s - 2]), direction(*qs, pt)) *
+                           geometry(*qs, pt) *
+                           pt.f(direction(pt, cameraPath[t - 2]), direction(pt, *qs)) *
+                           pt.throughput;
+        }
+        if (contribution == glm::dvec3(0)) return contribution;
+        if (s > 0 && !visible(pt, *qs, rays)) return glm::dvec3(0);
+        return contribution * bidirectionalWeight(plane, lightPath, s, cameraPath, t, sampled);
+    }
+
+    /// Multiple importance sampling weight of the path that connects `s` light and `t` camera
+    /// vertices, against all other connections that generate the same path. It is computed from
+    /// the ratios of the densities with which the subpaths generate each vertex [Veach 1997, 10.2].
+    /// `sampled` is the emitter vertex of light sampling (s == 1). Mis::None falls back to the
+    /// balance heuristic, as the connections need some weighting to be combined.
+    double bidirectionalWeight(const ImagePlane& plane, const Subpath& lightPath, int s,
+                               const Subpath& cameraPath, int t, const PathVertex& sampled) const {
+        if (s + t == 2) return 1;
+
+        // Densities of the vertices, as far as the connection changes them
+        std::array<double, kMaxSubpathVertices> cameraFwd, cameraRev, lightFwd, lightRev;
+        std::array<bool, kMaxSubpathVertices> cameraDelta, lightDelta;
+        for (int i = 0; i < t; ++i) {
+            cameraFwd[i] = cameraPath[i].pdfFwd;
+            cameraRev[i] = cameraPath[i].pdfRev;
+            cameraDelta[i] = cameraPath[i].delta;
+        }
+        for (int i = 0; i < s; ++i) {
+            const PathVertex& vertex = s == 1 ? sampled : lightPath[i];
+            lightFwd[i] = vertex.pdfFwd;
+            lightRev[i] = vertex.pdfRev;
+            lightDelta[i] = vertex.delta;
+        }
+
+        const PathVertex& pt = cameraPath[t - 1];
+        const PathVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+        const PathVertex* qs = s == 1 ? &sampled : s > 1 ? &lightPath[s - 1] : nullptr;
+        const PathVertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+        if (s == 0) {
+            // Only hitting it can find an emitter that light paths do not start on
+            double origin = _emitters.powerProbability(pt.entity);
+            if (origin == 0) return 1;
+            cameraRev[t - 1] = origin / pt.entity->area();
+            cameraRev[t - 2] = pt.toArea(emissionPdf(pt, direction(pt, *ptMinus)), *ptMinus);
+        } else {
+            cameraRev[t - 1] = qs->toArea(scatterPdf(plane, *qs, qsMinus, pt), pt);
+            if (t > 1) cameraRev[t - 2] = pt.toArea(scatterPdf(plane, pt, qs, *ptMinus), *ptMinus);
+            lightRev[s - 1] = pt.toArea(scatterPdf(plane, pt, ptMinus, *qs), *qs);
+            if (s > 1) {
+                lightRev[s - 2] = qs->toArea(scatterPdf(plane, *qs, &pt, *qsMinus), *qsMinus);
+            }
+            lightDelta[s - 1] = false;
+        }
+        cameraDelta[t - 1] = false;
+
+        // Densities of specular vertices are 0 and cancel out of the ratios.
+        auto remap = [](double pdf) { return pdf != 0 ? pdf : 1; };
+        auto heuristic = [&](double ratio) { return _mis == Mis::Power ? ratio * ratio : ratio; };
+        double sum = 0;
+        double ratio = 1;
+        for (int i = t - 1; i > 0; --i) {
+            ratio *= remap(cameraRev[i]) / remap(cameraFwd[i]);
+            if (!cameraDelta[i] && !cameraDelta[i - 1]) sum += heuristic(ratio);
+        }
+        ratio = 1;
+        for (int i = s - 1; i >= 0; --i) {
+            ratio *= remap(lightRev[i]) / remap(lightFwd[i]);
+            if (!lightDelta[i] && !(i > 0 && lightDelta[i - 1])) sum += heuristic(ratio);
+        }
+        return 1 / (1 + sum);
+    }
+
+    /// Solid angle density with which `vertex`, reached from `previous`, samples the direction
+    /// towards `next`.
+    static double scatterPdf(const ImagePlane& plane, const PathVertex& vertex,
+                             const PathVertex* previous, const PathVertex& next) {
+        glm::dvec3 wo = direction(vertex, next);
+        switch (vertex.type) {
+        case PathVertex::Type::Camera:
+            return plane.directionPdf(wo);
+        case PathVertex::Type::Light:
+            return emissionPdf(vertex, wo);
+        case PathVertex::Type::Surface:
+            break;
+        }
+        return vertex.pdf(direction(vertex, *previous), wo);
+    }
+
+    /// Solid angle density of emitting light from `vertex` in the direction `dir`.
+    static double emissionPdf(const PathVertex& vertex, const glm::dvec3& dir) {
+        return std::fabs(glm::dot(vertex.normal, dir)) / (2 * glm::pi<double>());
+    }
+
+    /// Normalized direction from `from` to `to`.
+    static glm::dvec3 direction(const PathVertex& from, const PathVertex& to) {
+        return glm::normalize(to.point - from.point);
+    }
+
+    /// Geometry term between two vertices: the cosines at both ends over the squared distance.
+    static double geometry(const PathVertex& a, const PathVertex& b) {
+        glm::dvec3 d = b.point - a.point;
+        double distance2 = glm::dot(d, d);
+        d /= std::sqrt(distance2);
+        return std::fabs(glm::dot(a.normal, d)) * std::fabs(glm::dot(b.normal, d)) / distance2;
+    }
+
+    /// Checks that nothing lies between two vertices, starting and ending the shadow ray just off
+    /// the surfaces on the side facing the other vertex. Triangles can only be hit from the front,
+    /// so shadow rays start at the camera side `a` to see what camera rays would see.
+    bool visible(const PathVertex& a, const PathVertex& b, int& rays) {
+        auto offset = [](const PathVertex& v, const glm::dvec3& towards) {
+            if (v.type == PathVertex::Type::Camera) return v.point;
+            double side = glm::dot(towards - v.point, v.normal) > 0 ? 1 : -1;
+            return v.point + v.normal * (side * 1e-3);
+        };
+        glm::dvec3 from = offset(a, b.point);
+        glm::dvec3 d = offset(b, a.point) - from;
+        ++rays;
+        return !occluded(Ray(from, d), glm::length(d));
+    }
+
+    /// Cosine distributed direction around the unit vector `w` for the uniform values `u`.
+    static glm::dvec3 cosineDirection(const glm::dvec3& w, const glm::dvec2& u) {
+        double r1 = 2 * glm::pi<double>() * u.x;
+        double r2s = std::sqrt(u.y);
+        glm::dvec3 a = glm::normalize(
+            glm::cross(std::fabs(w.x) > .1 ? glm::dvec3(0, 1, 0) : glm::dvec3(1, 0, 0), w));
+        glm::dvec3 b = glm::cross(w, a);
+        return glm::normalize(a * std::cos(r1) * r2s + b * std::sin(r1) * r2s +
+                              w * std::sqrt(1 - u.y));
+    }
+
+    /// Emits `count` photons and builds a photon map of the ones that reach diffuse surfaces. The
+    /// caustic map takes the photons that got there through specular surfaces alone. The global
+    /// map takes all others, except for light that comes straight from an emitter, which is
+    /// sampled directly instead. Photons are traced in batches on all threads, and every batch
+    /// stores its photons in order, so maps do not depend on the number of threads.
+    PhotonMap tracePhotons(int count, bool caustic) {
+        if (count <= 0) return PhotonMap();
+
+        double backgroundProbability = photonBackgroundProbability();
+        size_t photons = static_cast<size_t>(count);
+        size_t batches = (photons + kPhotonBatch - 1) / kPhotonBatch;
+        std::vector<std::vector<Photon>> stored(batches);
+        TaskScheduler::run(batches, _threads, [&](size_t batch, unsigned) {
+            std::vector<Photon>& batchPhotons = stored[batch];
+            size_t end = std::min(photons, (batch + 1) * kPhotonBatch);
+            for (size_t i = batch * kPhotonBatch; i < end; ++i) {
+                Sampler<sampling::Sobol> sampler(caustic ? 1 : 0, 0, static_cast<uint32_t>(i),
+                                                 static_cast<uint32_t>(count));
+                Ray ray;
+                glm::dvec3 power;
+                bool fromBackground;
+                if (!emitPhoton(sampler, backgroundProbability, ray, power, fromBackground)) {
+                    continue;
+                }
+                tracePhoton(ray, power * (1.0 / count), fromBackground, sampler,
+                            [&](const glm::dvec3& point, const glm::dvec3& power,
+                                const glm::dvec3& dir, bool direct, bool causticPath) {
+                                if (caustic) {
+                                    if (causticPath) batchPhotons.emplace_back(point, power, dir);
+                                    return false;
+                                }
+                                if (!direct && !causticPath) {
+                                    batchPhotons.emplace_back(point, power, dir);
+                                }
+                                return true;
+                            });
+            }
+        });
+
+        std::vector<Photon> all;
+        size_t size = 0;
+        for (const auto& batch : stored) size += batch.size();
+        all.reserve(size);
+        for (const auto& batch : stored) all.insert(all.end(), batch.begin(), batch.end());
+        stored.clear();
+        return PhotonMap(std::move(all), _threads);
+    }
+
+    /// Probability with which emitPhoton() emits photons from the background rather than from
+    /// the emitters, proportional to their power.
+    double photonBackgroundProbability() const {
+        // The background surrounds the scene and sends radiance 0.9 into its bounding sphere.
+        double backgroundPower = 4 * glm::pi<double>() * glm::pi<double>() * _sceneRadius *
+                                 _sceneRadius * luminance(glm::dvec3(.9, .9, .9));
+        // Emitters light both of their sides.
+        double emitterPower = 2 * _emitters.power();
+        return backgroundPower / (backgroundPower + emitterPower);
+    }
+
+    /// Samples the ray of a photon that leaves an emitter, or the background with probability
+    /// `backgroundProbability`, and its power: the emitted light over the density of the ray.
+    /// Returns false if no photon could be emitted.
+    template <typename Pattern>
+    bool emitPhoton(Sampler<Pattern>& sampler, double backgroundProbability, Ray& ray,
+                    glm::dvec3& power, bool& fromBackground) {
+        sampler.startVertex(0);
+        fromBackground = sampler.get1D() < backgroundProbability;
+        if (fromBackground) {
+            // Parallel light from a uniformly chosen direction, through a disc that covers the
+            // scene.
+            glm::dvec2 u = sampler.get2D(), v = sampler.get2D();
+            double z = 1 - 2 * u.x;
+            double r = std::sqrt(std::max(0.0, 1 - z * z));
+            double phi = 2 * glm::pi<double>() * u.y;
+            glm::dvec3 dir(r * std::cos(phi), r * std::sin(phi), z);
+            glm::dvec3 a = glm::normalize(glm::cross(
+                std::fabs(dir.x) > .1 ? glm::dvec3(0, 1, 0) : glm::dvec3(1, 0, 0), dir));
+            glm::dvec3 b = glm::cross(dir, a);
+            double angle = 2 * glm::pi<double>() * v.y;
+            glm::dvec3 offset = (a * std::cos(angle) + b * std::sin(angle)) * std::sqrt(v.x);
+            ray = Ray(_sceneCenter + (offset - dir) * _sceneRadius, dir);
+            power = glm::dvec3(.9, .9, .9) * // background color
+                    (4 * glm::pi<double>() * glm::pi<double>() * _sceneRadius * _sceneRadius /
+                     backgroundProbability);
+            return true;
+        }
+
+        double selection;
+        Entity* light = _emitters.selectByPower(sampler.get1D(), selection);
+        glm::dvec3 point, normal;
+        if (!light->samplePoint(sampler.get2D(), point, normal)) return false;
+        glm::dvec2 u = sampler.get2D();
+        normal = u.x < 0.5 ? normal : -normal;
+        u.x = u.x < 0.5 ? 2 * u.x : 2 * u.x - 1;
+        ray = Ray(point + normal * 1e-3, cosineDirection(normal, u));
+        // Densities of the point, the side and the cosine distributed direction
+        power = light->material->emission *
+                (2 * glm::pi<double>() * light->area() / (selection * (1 - backgroundProbability)));
+        return true;
+    }
+
+    /// Follows a photon with `power` through the scene. Where it hits a diffuse surface, it calls
+    /// `deposit(point, power, direction, direct, caustic)`, where `direct` tells if the photon
+    /// comes straight from an emitter and `caustic` if it got there through specular surfaces
+    /// alone. The photon stops if `deposit` returns false.
+    template <typename Pattern, typename Deposit>
+    void tracePhoton(Ray ray, glm::dvec3 power, bool fromBackground, Sampler<Pattern>& sampler,
+                     Deposit deposit) {
+        bool diffuse = false;
+        for (int bounce = 0; bounce <= kMaxBounces; ++bounce) {
+            sampler.startVertex(bounce + 1);
+            Hit hit;
+            _scene->intersect(ray, hit);
+            glm::dvec3 point, normal;
+            Material material;
+            if (!resolveHit(ray, hit, point, normal, material)) return;
+
+            if (material.materialType == MaterialType::Diffuse) {
+                bool direct = bounce == 0 && !fromBackground;
+                if (!deposit(point, power, ray.dir, direct, bounce > 0 && !diffuse)) return;
+                diffuse = true;
+            }
+
+            PathVertex vertex = PathVertex::surface(hit.entity, point, normal, material, power);
+            glm::dvec3 wi, weight;
+            double pdf, pdfRev;
+            if (!sampleBsdf(vertex, -ray.dir, sampler, wi, pdf, pdfRev, weight)) return;
+            // Russian roulette keeps the power of photons about the same as they bounce.
+            double p = std::max(weight.x, std::max(weight.y, weight.z));
+            if (sampler.get1D() >= p) return;
+            power *= weight * (1 / p);
+            ray = Ray(point + normal * (glm::dot(wi, normal) > 0 ? 1e-3 : -1e-3), wi);
+        }
+    }
+
+    /// Follows a primary ray through specular surfaces to the first diffuse one, adding the
+    /// emission and background it sees to the result. At the diffuse surface, it adds
+    /// `shade(point, orientedNormal, material, throughput)`, where `throughput` is that of the
+    /// path up to the surface.
+    template <typename Pattern, typename Shade>
+    glm::dvec3 traceToDiffuse(Ray ray, Sampler<Pattern>& sampler, int& rays, Shade shade) {
+        glm::dvec3 throughput(1), result(0);
+        for (int bounce = 0; bounce <= kMaxBounces; ++bounce) {
+            sampler.startVertex(bounce + 1);
+            ++rays;
+            Hit hit;
+            _scene->intersect(ray, hit);
+            glm::dvec3 point, normal;
+            Material material;
+            if (!resolveHit(ray, hit, point, normal, material)) {
+                result += throughput * glm::dvec3(.9, .9, .9); // background color
+                break;
+            }
+            result += throughput * material.emission;
+
+            glm::dvec3 orientedNormal = glm::dot(normal, ray.dir) < 0 ? normal : -normal;
+            if (material.materialType == MaterialType::Diffuse) {
+                result += shade(point, orientedNormal, material, throughput);
+                break;
+            }
+            PathVertex vertex =
+                PathVertex::surface(hit.entity, point, normal, material, throughput);
+            glm::dvec3 wi, weight;
+            double pdf, pdfRev;
+            if (!sampleBsdf(vertex, -ray.dir, sampler, wi, pdf, pdfRev, weight)) break;
+            throughput *= weight;
+            ray = Ray(point + normal * (glm::dot(wi, normal) > 0 ? 1e-3 : -1e-3), wi);
+        }
+        return result;
+    }
+
+    /// Estimates the radiance along a primary ray with the photon maps, see reflectedRadiance().
+    template <typename Pattern>
+    glm::dvec3 photonRadiance(const Ray& ray, Sampler<Pattern>& sampler, int& rays) {
+        return traceToDiffuse(ray, sampler, rays,
+                              [&](const glm::dvec3& point, const glm::dvec3& orientedNormal,
+                                  const Material& material, const glm::dvec3& throughput) {
+                                  return throughput * reflectedRadiance(point, orientedNormal,
+                                                                        material.color, sampler,
+                                                                        true, rays);
+                              });
+    }
+
+    /// Camera pass of progressive photon mapping: records the first diffuse surface that a
+    /// primary ray reaches as the visible point of `pixel` and returns the light that the photons
+    /// do not carry, i.e. the emission seen along the ray and the light sampled directly there.
+    template <typename Pattern>
+    glm::dvec3 visiblePoint(const Ray& ray, Sampler<Pattern>& sampler, int& rays,
+                            ProgressivePixel& pixel) {
+        pixel.weight = glm::dvec3(0);
+        return traceToDiffuse(ray, sampler, rays,
+                              [&](const glm::dvec3& point, const glm::dvec3& orientedNormal,
+                                  const Material& material, const glm::dvec3& throughput) {
+                                  pixel.point = point;
+                                  pixel.normal = orientedNormal;
+                                  pixel.weight = throughput * material.color * (1.0 / M_PI);
+                                  return pixel.weight * sampleLight(point, orientedNormal,
+                                                                    sampler, false, rays);
+                              });
+    }
+
+    /// Photon pass of progressive photon mapping: emits `count` photons and adds the flux of
+    /// those that land within the radius of a visible point in `grid` to the pixel in `flux`.
+    /// Light straight from the emitters is left out, the camera pass samples it directly.
+    void traceProgressivePhotons(int count, int pass, std::vector<ProgressivePixel>& pixels,
+                                 const VisiblePointGrid& grid, int width, SplatBuffer& flux) {
+        double backgroundProbability = photonBackgroundProbability();
+        size_t photons = static_cast<size_t>(count);
+        size_t batches = (photons + kPhotonBatch - 1) / kPhotonBatch;
+        TaskScheduler::run(batches, _threads, [&](size_t batch, unsigned) {
+            size_t end = std::min(photons, (batch + 1) * kPhotonBatch);
+            for (size_t i = batch * kPhotonBatch; i < end && running(); ++i) {
+                // Every pass scrambles the points differently.
+                Sampler<sampling::Sobol> sampler(2, static_cast<uint32_t>(pass),
+                                                 static_cast<uint32_t>(i),
+                                                 static_cast<uint32_t>(count));
+                Ray ray;
+                glm::dvec3 power;
+                bool fromBackground;
+                if (!emitPhoton(sampler, backgroundProbability, ray, power, fromBackground)) {
+                    continue;
+                }
+                tracePhoton(ray, power * (1.0 / count), fromBackground, sampler,
+                            [&](const glm::dvec3& point, const glm::dvec3& power,
+                                const glm::dvec3& dir, bool direct, bool) {
+                                if (direct) return true;
+                                grid.visit(point, [&](uint32_t index) {
+                                    ProgressivePixel& pixel = pixels[index];
+                                    glm::dvec3 d = pixel.point - point;
+                                    if (glm::dot(d, d) >= pixel.radius * pixel.radius ||
+                                        glm::dot(dir, pixel.normal) >= 0) {
+                                        return;
+                                    }
+                                    pixel.hits.fetch_add(1, std::memory_order_relaxed);
+                                    flux.add(glm::dvec2(index % width, index / width),
+                                             pixel.weight * power);
+                                });
+                                return true;
+                            });
+            }
+        });
+    }
+
+    /// Light that a diffuse surface with `color` reflects at `point`, where it faces the viewer
+    /// with `orientedNormal`: direct light sampled from the emitters, caustics from the caustic
+    /// map and the remaining indirect light from the global map. With `gather`, the indirect light
+    /// is gathered with rays that read the maps where they hit diffuse surfaces, which hides the
+    /// blotches of the global map. Light sampling and the caustic map already account for gather
+    /// rays that find the emitters or the background through specular surfaces.
+    template <typename Pattern>
+    glm::dvec3 reflectedRadiance(const glm::dvec3& point, const glm::dvec3& orientedNormal,
+                                 const glm::dvec3& color, Sampler<Pattern>& sampler, bool gather,
+                                 int& rays) {
+        glm::dvec3 irradiance =
+            sampleLight(point, orientedNormal, sampler, false, rays) +
+            _causticMap.irradiance(point, orientedNormal, kCausticNearest,
+                                   kCausticRadius * _sceneRadius);
+        if (!gather || _gatherRays <= 0) {
+            // Without gathering, this is the point seen by the camera, or else a gather hit.
+            irradiance += _globalMap.irradiance(point, orientedNormal,
+                                                gather ? kGlobalNearest : kGatherNearest,
+                                                kGlobalRadius * _sceneRadius);
+            return color * irradiance * (1 / glm::pi<double>());
+        }
+
+        // Cosine distributed gather rays weight the light they find with the color alone.
+        glm::dvec3 gathered(0);
+        for (int i = 0; i < _gatherRays; ++i) {
+            int samplerVertex = kGatherSamplerVertex + i * kMaxSubpathVertices;
+            sampler.startVertex(samplerVertex);
+            glm::dvec3 dir = cosineDirection(orientedNormal, sampler.get2D());
+            Ray ray(point + orientedNormal * 1e-3, dir);
+            glm::dvec3 throughput(1);
+            for (int bounce = 0; bounce <= kMaxBounces; ++bounce) {
+                sampler.startVertex(samplerVertex + bounce + 1);
+                ++rays;
+                Hit hit;
+                _scene->intersect(ray, hit);
+                glm::dvec3 hitPoint, normal;
+                Material material;
+                if (!resolveHit(ray, hit, hitPoint, normal, material)) {
+                    if (bounce == 0) gathered += glm::dvec3(.9, .9, .9); // background color
+                    break;
+                }
+                if (material.materialType == MaterialType::Diffuse) {
+                    glm::dvec3 n = glm::dot(normal, ray.dir) < 0 ? normal : -normal;
+                    gathered += throughput * reflectedRadiance(hitPoint, n, material.color,
+                                                               sampler, false, rays);
+                    break;
+                }
+                PathVertex vertex =
+                    PathVertex::surface(hit.entity, hitPoint, normal, material, throughput);
+                glm::dvec3 wi, weight;
+                double pdf, pdfRev;
+                if (!sampleBsdf(vertex, -ray.dir, sampler, wi, pdf, pdfRev, weight)) break;
+                throughput *= weight;
+                ray = Ray(hitPoint + normal * (glm::dot(wi, normal) > 0 ? 1e-3 : -1e-3), wi);
+            }
+        }
+        return color * (irradiance * (1 / glm::pi<double>()) + gathered * (1.0 / _gatherRays));
+    }
+
+    /// Shared by copies, as atomics cannot be copied. Copies are made before rendering starts.
+    std::shared_ptr<std::atomic<bool>> _running = std::make_shared<std::atomic<bool>>(false);
+    const Accelerator* _scene;
+    EmitterList _emitters;
     Camera _camera;
     std::vector<Light*> _lights;
+    LightTree _lightTree;
+    /// Bounding sphere of the scene.
+    glm::dvec3 _sceneCenter = glm::dvec3(0);
+    double _sceneRadius = 0;
+    PhotonMap _globalMap;
+    PhotonMap _causticMap;
     std::shared_ptr<Image> _image;
-    bool isPathTracing = false;
+    std::shared_ptr<Image> _heatmap;
+    int _packetSize = 0;
+    unsigned _threads = std::thread::hardware_concurrency();
+    Integrator _integrator = Integrator::Whitted;
+    int _samples = 1024;
+    SamplerType _sampler = SamplerType::Sobol;
+    int _splitBounces = 1;
+    Mis _mis = Mis::Power;
+    double _pruneThreshold = kDefaultPruneThreshold;
+    double _lightCut = kDefaultLightCut;
+    double _raysPerSample = 0;
+    double _adaptiveThreshold = 0;
+    int _photonCount = 1000000;
+    int _causticPhotonCount = 1000000;
+    int _gatherRays = 1;
+    int _passPhotons = 0;
+    double _irradianceAccuracy = 0;
+    int _irradianceRays = 256;
+    std::shared_ptr<IrradianceCache> _irradianceCache;
+    int _radianceCacheBounces = 0;
+    std::shared_ptr<RadianceCache> _radianceCache;
+    /// Size of a pixel at unit distance from the camera.
+    double _pixelSize = 0;
+    size_t _progressiveMemory = 0;
 };
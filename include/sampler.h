@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "random.h"
+
+/// Point sets the path tracer draws its sample values from.
+enum class SamplerType {
+    Independent, ///< Independent uniform random values.
+    Stratified,  ///< Jittered strata, shuffled independently for every dimension.
+    Sobol,       ///< Owen-scrambled Sobol points, scrambled independently for every pixel.
+    BlueNoise,   ///< Sobol points shared by all pixels and shifted by a blue noise mask.
+};
+
+/// Sample values of one path. A path asks for values vertex by vertex, and the dimension of a
+/// value is given by its vertex and the order in which the vertex asks for it, so decisions at
+/// different vertices never share a dimension. `Pattern` spreads the values of every dimension
+/// evenly over the samples of a pixel. Dimensions are decorrelated by seeding each of them
+/// differently instead of using ever higher dimensions of the point set, which are poorly
+/// distributed.
+template <typename Pattern>
+class Sampler {
+  public:
+    /// Sample `index` of `count` of pixel (x, y). The camera uses vertex 0.
+    Sampler(uint32_t x, uint32_t y, uint32_t index, uint32_t count)
+        : _x(x), _y(y), _index(index), _count(count) {}
+
+    void startVertex(int vertex) {
+        _vertex = static_cast<uint32_t>(vertex);
+        _slot = 0;
+    }
+
+    double get1D() { return Pattern::sample1D(_index, _count, nextDimension(), _x, _y); }
+
+    glm::dvec2 get2D() { return Pattern::sample2D(_index, _count, nextDimension(), _x, _y); }
+
+  private:
+    uint64_t nextDimension() { return hash64(uint64_t(_vertex) << 32 | _slot++); }
+
+    uint32_t _x, _y;
+    uint32_t _index;
+    uint32_t _count;
+    uint32_t _vertex = 0;
+    uint32_t _slot = 0;
+};
+
+namespace sampling {
+
+/// Key of a pixel to combine with a dimension.
+inline uint64_t pixelKey(uint32_t x, uint32_t y) { return uint64_t(y) << 16 ^ x; }
+
+/// Random permutation of [0, size) selected by `seed`, evaluated at `i` without a table
+/// [Kensler 2013, Correlated Multi-Jittered Sampling].
+inline uint32_t permute(uint32_t i, uint32_t size, uint32_t seed) {
+    uint32_t w = size - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= size);
+    return (i + seed) % size;
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+/// Owen scrambling in base 2: a random permutation of [0, 2^32) that keeps all elementary
+/// intervals intact [Burley 2020, Practical Hash-based Owen Scrambling].
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverseBits(x);
+}
+
+/// First two dimensions of the Sobol sequence as 32-bit fractions. The first is the van der
+/// Corput sequence, the direction numbers of the second follow from the polynomial x + 1.
+inline void sobol2D(uint32_t index, uint32_t& x, uint32_t& y) {
+    x = reverseBits(index);
+    y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) y ^= v;
+    }
+}
+
+/// Owen-scrambled Sobol point `index` for the dimension seed. The index is shuffled as well, so
+/// that different dimensions use the points in different order and are not correlated.
+inline glm::dvec2 scrambledSobol2D(uint32_t index, uint64_t seed) {
+    uint32_t x, y;
+    sobol2D(owenScramble(index, static_cast<uint32_t>(seed)), x, y);
+    x = owenScramble(x, static_cast<uint32_t>(seed >> 32));
+    y = owenScramble(y, static_cast<uint32_t>(hash64(seed)));
+    return {x * (1.0 / 4294967296.0), y * (1.0 / 4294967296.0)};
+}
+
+inline double scrambledSobol1D(uint32_t index, uint64_t seed) {
+    uint32_t x = reverseBits(owenScramble(index, static_cast<uint32_t>(seed)));
+    return owenScramble(x, static_cast<uint32_t>(seed >> 32)) * (1.0 / 4294967296.0);
+}
+
+/// Tileable blue noise mask: a permutation of [0, kSize^2) whose values are spread evenly both
+/// in space and in value, made with the void-and-cluster method [Ulichney 1993]. It is built
+/// once, on first use.
+class BlueNoiseMask {
+  public:
+    static constexpr int kSize = 64;
+
+    static const BlueNoiseMask& instance() {
+        static const BlueNoiseMask mask;
+        return mask;
+    }
+
+    /// Value in (0, 1) at pixel (x, y) of the mask shifted by `offset`.
+    double value(uint32_t x, uint32_t y, uint64_t offset) const {
+        uint32_t px = (x + static_cast<uint32_t>(offset)) % kSize;
+        uint32_t py = (y + static_cast<uint32_t>(offset >> 32)) % kSize;
+        return (_rank[py * kSize + px] + 0.5) / (kSize * kSize);
+    }
+
+  private:
+    BlueNoiseMask() : _rank(kSize * kSize) {
+        const int n = kSize * kSize;
+
+        // Gaussian energy kernel on the torus
+        std::vector<float> kernel(n);
+        for (int y = 0; y < kSize; ++y) {
+            for (int x = 0; x < kSize; ++x) {
+                int dx = std::min(x, kSize - x);
+                int dy = std::min(y, kSize - y);
+                kernel[y * kSize + x] = std::exp(-(dx * dx + dy * dy) / (2 * 1.5f * 1.5f));
+            }
+        }
+
+        std::vector<char> ones(n, 0);
+        std::vector<float> energy(n, 0);
+        auto update = [&](int p, float sign) {
+            int px = p % kSize, py = p / kSize;
+            for (int y = 0; y < kSize; ++y) {
+                const float* row = &kernel[((y - py + kSize) % kSize) * kSize];
+                for (int x = 0; x < kSize; ++x) {
+                    energy[y * kSize + x] += sign * row[(x - px + kSize) % kSize];
+                }
+            }
+        };
+        // The one with the highest energy among ones, or the zero with the lowest among zeros.
+        auto tightestCluster = [&]() {
+            int best = -1;
+            for (int p = 0; p < n; ++p) {
+                if (ones[p] && (best < 0 || energy[p] > energy[best])) best = p;
+            }
+            return best;
+        };
+        auto largestVoid = [&]() {
+            int best = -1;
+            for (int p = 0; p < n; ++p) {
+                if (!ones[p] && (best < 0 || energy[p] < energy[best])) best = p;
+            }
+            return best;
+        };
+
+        // Initial pattern: random points, relaxed by moving the tightest cluster into the largest
+        // void until that no longer changes anything. Limited in case the moves cycle.
+        int initial = n / 10;
+        for (int i = 0, placed = 0; placed < initial; ++i) {
+            int p = static_cast<int>(hash64(i) % n);
+            if (ones[p]) continue;
+            ones[p] = 1;
+            update(p, 1);
+            ++placed;
+        }
+        for (int i = 0; i < n; ++i) {
+            int cluster = tightestCluster();
+            ones[cluster] = 0;
+            update(cluster, -1);
+            int hole = largestVoid();
+            ones[hole] = 1;
+            update(hole, 1);
+            if (hole == cluster) break;
+        }
+        std::vector<char> pattern = ones;
+        std::vector<float> patternEnergy = energy;
+
+        // Ranks below the initial pattern: remove tightest clusters.
+        for (int rank = initial - 1; rank >= 0; --rank) {
+            int cluster = tightestCluster();
+            ones[cluster] = 0;
+            update(cluster, -1);
+            _rank[cluster] = rank;
+        }
+        // Ranks above: fill the largest voids.
+        ones = pattern;
+        energy = patternEnergy;
+        for (int rank = initial; rank < n; ++rank) {
+            int hole = largestVoid();
+            ones[hole] = 1;
+            update(hole, 1);
+            _rank[hole] = rank;
+        }
+    }
+
+    std::vector<int> _rank;
+};
+
+/// Patterns for Sampler. Each maps sample `index` of `count` in a dimension to a value.
+
+struct Independent {
+    static double sample1D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                           uint32_t y) {
+        return stream(index, dimension, x, y).next();
+    }
+
+    static glm::dvec2 sample2D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                               uint32_t y) {
+        RandomStream random = stream(index, dimension, x, y);
+        double u = random.next();
+        return {u, random.next()};
+    }
+
+    static RandomStream stream(uint32_t index, uint64_t dimension, uint32_t x, uint32_t y) {
+        return RandomStream(static_cast<uint32_t>(hash64(dimension ^ pixelKey(x, y))), index);
+    }
+};
+
+/// Samples are spread over `count` strata in 1D and the largest square grid of strata in 2D, in
+/// an order that is shuffled for every pixel and dimension.
+struct Stratified {
+    static double sample1D(uint32_t index, uint32_t count, uint64_t dimension, uint32_t x,
+                           uint32_t y) {
+        uint64_t seed = hash64(dimension ^ pixelKey(x, y));
+        uint32_t round = index / count;
+        uint64_t key = hash64(seed + round);
+        uint32_t stratum = permute(index % count, count, static_cast<uint32_t>(key));
+        return (stratum + toUnit(hash64(key + index))) / count;
+    }
+
+    static glm::dvec2 sample2D(uint32_t index, uint32_t count, uint64_t dimension, uint32_t x,
+                               uint32_t y) {
+        uint32_t side = static_cast<uint32_t>(std::sqrt(double(count)));
+        side = side > 0 ? side : 1;
+        uint32_t strata = side * side;
+        uint64_t seed = hash64(dimension ^ pixelKey(x, y));
+        uint64_t key = hash64(seed + index / strata);
+        uint32_t stratum = permute(index % strata, strata, static_cast<uint32_t>(key));
+        uint64_t jitter = hash64(key + 2 * uint64_t(index));
+        return {(stratum % side + toUnit(jitter)) / side,
+                (stratum / side + toUnit(hash64(jitter))) / side};
+    }
+};
+
+/// Owen-scrambled Sobol points with an independent scramble for every pixel and dimension.
+struct Sobol {
+    static double sample1D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                           uint32_t y) {
+        return scrambledSobol1D(index, hash64(dimension ^ pixelKey(x, y)));
+    }
+
+    static glm::dvec2 sample2D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                               uint32_t y) {
+        return scrambledSobol2D(index, hash64(dimension ^ pixelKey(x, y)));
+    }
+};
+
+/// Blue-noise dithered sampling [Georgiev and Fajardo 2016]: all pixels use the same scrambled
+/// Sobol points, shifted toroidally by the blue noise mask. Neighbouring pixels get shifts that
+/// differ as much as possible, so the error at low sample counts is blue noise, which is far less
+/// visible than white noise.
+struct BlueNoise {
+    static double sample1D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                           uint32_t y) {
+        double value = scrambledSobol1D(index, dimension) +
+                       BlueNoiseMask::instance().value(x, y, hash64(dimension));
+        return value - std::floor(value);
+    }
+
+    static glm::dvec2 sample2D(uint32_t index, uint32_t /*count*/, uint64_t dimension, uint32_t x,
+                               uint32_t y) {
+        const BlueNoiseMask& mask = BlueNoiseMask::instance();
+        glm::dvec2 value = scrambledSobol2D(index, dimension) +
+                           glm::dvec2(mask.value(x, y, hash64(dimension)),
+                                      mask.value(x, y, hash64(dimension + 1)));
+        return value - glm::floor(value);
+    }
+};
+
+} // namespace sampling
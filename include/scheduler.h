@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Runs a fixed number of independent tasks on a group of threads with work stealing. Every thread
+/// starts with a contiguous share of the tasks and executes it from the front. A thread that runs
+/// out of work steals the back half of the largest remaining share, so all threads stay busy
+/// even if tasks take very different times, e.g. image tiles with and without geometry.
+///
+/// The threads are kept in a pool that lives as long as the process and wait on a condition
+/// variable between runs, so that progressive rendering, which runs once or twice per pass,
+/// does not start and join threads for every pass.
+class TaskScheduler {
+  public:
+    /// Calls `task(index, thread)` for every index in [0, count) on up to `threads` threads and
+    /// returns when all tasks are done. The calling thread is one of the threads. Runs started
+    /// while another one is in progress, e.g. from within a task, execute on the calling thread.
+    template <typename Task>
+    static void run(size_t count, unsigned threads, Task task) {
+        threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, count)));
+        if (threads == 1 || !instance().execute(count, threads, &invoke<Task>, &task)) {
+            for (size_t i = 0; i < count; ++i) task(i, 0u);
+        }
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _shutdown = true;
+        }
+        _wake.notify_all();
+        for (auto& worker : _workers) worker.join();
+    }
+
+  private:
+    using Invoke = void (*)(void* task, size_t index, unsigned thread);
+
+    TaskScheduler() = default;
+
+    static TaskScheduler& instance() {
+        static TaskScheduler scheduler;
+        return scheduler;
+    }
+
+    template <typename Task>
+    static void invoke(void* task, size_t index, unsigned thread) {
+        (*static_cast<Task*>(task))(index, thread);
+    }
+
+    /// Runs the tasks on the calling thread and `threads - 1` workers, starting workers as far as
+    /// the pool has too few. Returns false without running anything if the pool is busy.
+    bool execute(size_t count, unsigned threads, Invoke invoke, void* task) {
+        std::unique_lock<std::mutex> job(_jobMutex, std::try_to_lock);
+        if (!job.owns_lock()) return false;
+
+        if (_shareCount < threads) {
+            _shares.reset(new Share[threads]);
+            _shareCount = threads;
+        }
+        for (unsigned t = 0; t < threads; ++t) {
+            _shares[t].begin = count * t / threads;
+            _shares[t].end = count * (t + 1) / threads;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            while (_workers.size() < threads - 1) {
+                unsigned thread = static_cast<unsigned>(_workers.size()) + 1;
+                _workers.emplace_back(&TaskScheduler::workerLoop, this, thread, _generation);
+            }
+            _invoke = invoke;
+            _task = task;
+            _threads = threads;
+            _open = true;
+            ++_generation;
+        }
+        _wake.notify_all();
+
+        // Once the calling thread runs out of tasks, workers that have not woken up yet have
+        // nothing left to do and skip the run, so only those that joined it are waited for.
+        work(0);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _open = false;
+        _done.wait(lock, [&] { return _active == 0; });
+        return true;
+    }
+
+    /// Waits for runs after generation `seen` and takes part in those that need `thread` and are
+    /// still open.
+    void workerLoop(unsigned thread, uint64_t seen) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _wake.wait(lock, [&] { return _shutdown || _generation != seen; });
+            if (_shutdown) return;
+            seen = _generation;
+            if (!_open || thread >= _threads) continue;
+            ++_active;
+            lock.unlock();
+            work(thread);
+            lock.lock();
+            if (--_active == 0) _done.notify_one();
+        }
+    }
+
+    void work(unsigned thread) {
+        size_t index;
+        while (pop(_shares[thread], index) || steal(_shares.get(), _threads, thread, index)) {
+            _invoke(_task, index, thread);
+        }
+    }
+
+    /// Range of task indices that are still to be executed. Padded to a cache line, so that
+    /// threads working on their own shares do not contend.
+    struct Share {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+        char padding[64];
+    };
+
+    static bool pop(Share& share, size_t& index) {
+        std::lock_guard<std::mutex> lock(share.mutex);
+        if (share.begin == share.end) return false;
+        index = share.begin++;
+        return true;
+    }
+
+    /// Moves the back half of the largest other share to the share of `thread` and takes its
+    /// first task. Returns false when no work is left.
+    static bool steal(Share* shares, unsigned threads, unsigned thread, size_t& index) {
+        while (true) {
+            unsigned victim = thread;
+            size_t largest = 0;
+            for (unsigned t = 0; t < threads; ++t) {
+                std::lock_guard<std::mutex> lock(shares[t].mutex);
+                if (t != thread && shares[t].end - shares[t].begin > largest) {
+                    largest = shares[t].end - shares[t].begin;
+                    victim = t;
+                }
+            }
+            if (victim == thread) return false;
+
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(shares[victim].mutex);
+                size_t size = shares[victim].end - shares[victim].begin;
+                // Another thread may have emptied the victim in the meantime.
+                if (size == 0) continue;
+                end = shares[victim].end;
+                begin = end - (size + 1) / 2;
+                shares[victim].end = begin;
+            }
+
+            std::lock_guard<std::mutex> lock(shares[thread].mutex);
+            index = begin;
+            shares[thread].begin = begin + 1;
+            shares[thread].end = end;
+            return true;
+        }
+    }
+
+    /// Held by the run in progress.
+    std::mutex _jobMutex;
+    /// Guards the workers and the description of the current run below.
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    std::vector<std::thread> _workers;
+    std::unique_ptr<Share[]> _shares;
+    unsigned _shareCount = 0;
+    Invoke _invoke = nullptr;
+    void* _task = nullptr;
+    unsigned _threads = 0;
+    /// Whether workers may still join the current run, and how many are executing its tasks.
+    bool _open = false;
+    unsigned _active = 0;
+    /// Number of runs started, which wakes the workers.
+    uint64_t _generation = 0;
+    bool _shutdown = false;
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "bbox.h"
+
+/// State of a pixel in stochastic progressive photon mapping [Hachisuka and Jensen 2009]. Every
+/// camera pass finds a visible point, the first diffuse surface the camera ray of the pixel
+/// reaches. The photons of the following pass that land within the radius of the point add to
+/// the flux of the pixel, and the radius shrinks as photons accumulate, so that the estimate
+/// converges to the radiance of the pixel.
+struct ProgressivePixel {
+    /// Reduction of the radius per pass; the fraction of new photons that is kept.
+    static constexpr double kAlpha = 2.0 / 3.0;
+
+    bool hasVisiblePoint() const { return weight != glm::dvec3(0); }
+
+    /// Adds the `passFlux` of the photons that hit the visible point in the last photon pass and
+    /// shrinks the radius.
+    void update(const glm::dvec3& passFlux) {
+        int m = hits.exchange(0, std::memory_order_relaxed);
+        if (m == 0) return;
+        double newPhotons = photons + kAlpha * m;
+        double newRadius = radius * std::sqrt(newPhotons / (photons + m));
+        flux = (flux + passFlux) * (newRadius * newRadius / (radius * radius));
+        photons = newPhotons;
+        radius = newRadius;
+    }
+
+    /// Radiance the photons of `passes` photon passes reflect towards the camera.
+    glm::dvec3 radiance(int passes) const {
+        if (passes <= 0) return glm::dvec3(0);
+        return flux / (passes * glm::pi<double>() * radius * radius);
+    }
+
+    /// Visible point of the current pass, with the normal facing the camera.
+    glm::dvec3 point = glm::dvec3(0);
+    glm::dvec3 normal = glm::dvec3(0);
+    /// Throughput of the camera path to the visible point times its diffuse reflectance, zero if
+    /// the pass found no visible point.
+    glm::dvec3 weight = glm::dvec3(0);
+    double radius = 0;
+    /// Number of photons the flux is made of, reduced by kAlpha.
+    double photons = 0;
+    /// Weighted power of the photons within the radius, summed over all passes.
+    glm::dvec3 flux = glm::dvec3(0);
+    /// Photons that hit the visible point in the current photon pass.
+    std::atomic<int> hits{0};
+};
+
+/// Spatial hash grid over the visible points of a pass, for finding those that a photon lands
+/// near. Cells are twice as large as the largest radius, so the points within reach of a photon
+/// lie in the 2 x 2 x 2 cells around it. Every point is stored in its own cell, and the cells are
+/// hashed into a table with one bucket per pixel, so the grid takes the same memory in every
+/// pass, however small the radii become.
+class VisiblePointGrid {
+  public:
+    /// Indexes the visible points of `pixels`.
+    void build(const std::vector<ProgressivePixel>& pixels) {
+        _bounds = BoundingBox();
+        double maxRadius = 0;
+        for (const ProgressivePixel& pixel : pixels) {
+            if (!pixel.hasVisiblePoint()) continue;
+            _bounds.grow(pixel.point);
+            maxRadius = std::fmax(maxRadius, pixel.radius);
+        }
+        _start.assign(pixels.size() + 1, 0);
+        _entries.clear();
+        _cellSize = 2 * maxRadius;
+        if (_cellSize <= 0) return;
+        _bounds.min -= glm::dvec3(_cellSize);
+        _bounds.max += glm::dvec3(_cellSize);
+
+        // Buckets are stored one after another: count the points per bucket, then place them.
+        for (const ProgressivePixel& pixel : pixels) {
+            if (pixel.hasVisiblePoint()) ++_start[bucket(cell(pixel.point)) + 1];
+        }
+        for (size_t i = 1; i < _start.size(); ++i) _start[i] += _start[i - 1];
+        _entries.resize(_start.back());
+        _next.assign(_start.begin(), _start.end() - 1);
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            if (!pixels[i].hasVisiblePoint()) continue;
+            glm::ivec3 c = cell(pixels[i].point);
+            _entries[_next[bucket(c)]++] = {c, static_cast<uint32_t>(i)};
+        }
+    }
+
+    /// Calls `visit(pixel)` with the index of every pixel whose visible point may lie within its
+    /// radius of `point`. Cells that share a bucket are told apart, so no pixel is visited twice.
+    template <typename Visitor>
+    void visit(const glm::dvec3& point, Visitor visit) const {
+        if (_entries.empty() || !_bounds.contains(point)) return;
+        // Per axis, points within reach lie in the cell of `point` or in the neighbor on the
+        // side of the half of the cell it is in.
+        glm::ivec3 first(glm::floor((point - _bounds.min) / _cellSize - 0.5));
+        for (int i = 0; i < 8; ++i) {
+            glm::ivec3 c = first + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2);
+            size_t b = bucket(c);
+            for (uint32_t e = _start[b]; e < _start[b + 1]; ++e) {
+                if (_entries[e].cell == c) visit(_entries[e].pixel);
+            }
+        }
+    }
+
+    /// Bytes taken by the grid.
+    size_t memoryUsage() const {
+        return _start.capacity() * sizeof(uint32_t) + _next.capacity() * sizeof(uint32_t) +
+               _entries.capacity() * sizeof(Entry);
+    }
+
+  private:
+    struct Entry {
+        glm::ivec3 cell;
+        uint32_t pixel;
+    };
+
+    glm::ivec3 cell(const glm::dvec3& point) const {
+        return glm::ivec3(glm::floor((point - _bounds.min) / _cellSize));
+    }
+
+    /// Spatial hash of [Teschner et al. 2003].
+    size_t bucket(const glm::ivec3& c) const {
+        uint32_t h = (static_cast<uint32_t>(c.x) * 73856093u) ^
+                     (static_cast<uint32_t>(c.y) * 19349663u) ^
+                     (static_cast<uint32_t>(c.z) * 83492791u);
+        return h % (_start.size() - 1);
+    }
+
+    /// Bounds of the visible points, grown by a cell. Photons outside of it reach no point.
+    BoundingBox _bounds;
+    double _cellSize = 0;
+    /// Entries of bucket b are [_start[b], _start[b + 1]).
+    std::vector<uint32_t> _start;
+    std::vector<uint32_t> _next;
+    std::vector<Entry> _entries;
+};
@@ -8,6 +8,7 @@
 #include <QWidget>
 #include <QCloseEvent>
 
+#include "allocations.h"
 #include "image.h"
 #include "raytracer.h"
 
@@ -40,7 +41,9 @@ class Viewer : public QWidget {
 
     void resizeEvent(QResizeEvent*) { restart_raytrace(); }
 
-    QImage getImage() const { return _raytracer.getImage()->_image; }
+    QImage getImage() const { return _raytracer.getImage()->toQImage(); }
+
+    QImage getHeatmap() const { return _raytracer.getHeatmap()->toQImage(); }
 
   private:
     void restart_raytrace() {
@@ -53,10 +56,21 @@ class Viewer : public QWidget {
             _durationText->setText("Running...");
             using namespace std::chrono;
             high_resolution_clock::time_point t1 = high_resolution_clock::now();
+            size_t allocations = allocationCount();
             this->_raytracer.run(this->width(), this->height());
+            allocations = allocationCount() - allocations;
             high_resolution_clock::time_point t2 = high_resolution_clock::now();
             auto duration = duration_cast<milliseconds>(t2 - t1).count();
-            _durationText->setText(QString::number(duration / (double)1000) + " seconds");
+            QString text = QString::number(duration / (double)1000) + " seconds";
+            text += ", " + QString::number(_raytracer.raysPerSample(), 'f', 2) + " rays/sample";
+            if (_raytracer.photonMemory() > 0) {
+                text += ", " + QString::number(_raytracer.photonMemory() / 1048576.0, 'f', 1) +
+                        " MB photons";
+            }
+#ifdef GI_COUNT_ALLOCATIONS
+            text += ", " + QString::number(allocations) + " allocations";
+#endif
+            _durationText->setText(text);
         });
     }
 
@@ -1,16 +1,107 @@
 #include <QApplication>
+#include <QCommandLineParser>
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <memory>
+#include <thread>
 
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Quad.h"
 #include "Sphere.h"
 #include "Triangle.h"
 #include "TriangleMesh.h"
+#include "bvh.h"
 #include "camera.h"
 #include "gui.h"
+#include "instance.h"
+#include "octree.h"
+#include "qbvh.h"
 
 int main(int argc, char** argv) {
     QApplication app(argc, argv);
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption acceleratorOption("accelerator", "Scene accelerator: octree, bvh or qbvh.",
+                                         "name", "octree");
+    parser.addOption(acceleratorOption);
+    QCommandLineOption packetOption(
+        "packet", "Trace primary rays in blocks of size x size pixels (up to 8), 0 to disable.",
+        "size", "0");
+    parser.addOption(packetOption);
+    QCommandLineOption instancesOption(
+        "instances", "Places copies of one shared sphere mesh on the floor, 0 for none.", "count",
+        "0");
+    parser.addOption(instancesOption);
+    QCommandLineOption threadsOption(
+        "threads", "Threads that build the scene and render, 0 for one per hardware thread.",
+        "count", "0");
+    parser.addOption(threadsOption);
+    QCommandLineOption integratorOption(
+        "integrator", "Rendering algorithm: whitted, path, bdpt, photon or sppm.", "name",
+        "whitted");
+    parser.addOption(integratorOption);
+    QCommandLineOption samplesOption("samples", "Samples per pixel of the path tracer.", "count",
+                                     "1024");
+    parser.addOption(samplesOption);
+    QCommandLineOption thresholdOption(
+        "threshold", "Relative error at which the path tracer stops sampling a pixel, 0 for never.",
+        "error", "0");
+    parser.addOption(thresholdOption);
+    QCommandLineOption samplerOption(
+        "sampler", "Path tracer samples: independent, stratified, sobol or bluenoise.", "name",
+        "sobol");
+    parser.addOption(samplerOption);
+    QCommandLineOption splitOption(
+        "split", "Bounces at which the path tracer follows both rays of a dielectric.", "count",
+        "1");
+    parser.addOption(splitOption);
+    QCommandLineOption pruneOption(
+        "prune", "Weight below which Whitted rays are not traced, 0 for the full ray tree.",
+        "weight", "0.001");
+    parser.addOption(pruneOption);
+    QCommandLineOption misOption("mis", "Path tracer light weighting: none, balance or power.",
+                                 "heuristic", "power");
+    parser.addOption(misOption);
+    QCommandLineOption lightCutOption(
+        "lightcut", "Size over distance below which Whitted shades a light cluster with one light.",
+        "ratio", "0.1");
+    parser.addOption(lightCutOption);
+    QCommandLineOption photonsOption("photons", "Photons emitted for the global photon map.",
+                                     "count", "1000000");
+    parser.addOption(photonsOption);
+    QCommandLineOption causticPhotonsOption(
+        "caustic-photons", "Photons emitted for the caustic photon map.", "count", "1000000");
+    parser.addOption(causticPhotonsOption);
+    QCommandLineOption gatherOption(
+        "gather", "Final gather rays per sample of the photon mapper, 0 to disable.", "count", "1");
+    parser.addOption(gatherOption);
+    QCommandLineOption passPhotonsOption(
+        "pass-photons", "Photons per pass of progressive photon mapping, 0 for one per pixel.",
+        "count", "0");
+    parser.addOption(passPhotonsOption);
+    QCommandLineOption irradianceCacheOption(
+        "irradiance-cache",
+        "Largest error of the path tracer's irradiance cache, e.g. 0.3, 0 to disable.", "error",
+        "0");
+    parser.addOption(irradianceCacheOption);
+    QCommandLineOption irradianceRaysOption(
+        "irradiance-rays", "Rays per irradiance cache record.", "count", "256");
+    parser.addOption(irradianceRaysOption);
+    QCommandLineOption radianceCacheOption(
+        "radiance-cache",
+        "Bounces after which paths end at the path tracer's radiance cache, e.g. 1, 0 to disable.",
+        "bounces", "0");
+    parser.addOption(radianceCacheOption);
+    parser.process(app);
+
+    // Zero threads means one per hardware thread, for the scene build as for rendering.
+    unsigned threads = parser.value(threadsOption).toUInt();
+    if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
     Camera camera({0, 0, 20});
 
     std::vector<Light*> lights;
@@ -27,17 +118,100 @@ int main(int argc, char** argv) {
     Material light(glm::dvec3(1.0), 0, glm::dvec4(0), 0, MaterialType::Diffuse, glm::dvec3(4.0));
 
     // Set up scene
-    Octree scene({-20, -20, -20}, {20, 20, 20});
-    scene.push_back(new Sphere({-1, -8, -10}, 2, ivory));
-    scene.push_back(new Sphere({-7, -8, -20}, 2, glass));
-    scene.push_back(new Sphere({7, -8, -10}, 2, red_rubber));
-    scene.push_back(new Sphere({4, -8, -20}, 2, mirror));
-    scene.push_back(new Sphere({0, 10, -15}, 2, light));
-    scene.push_back(new Triangle({-8, -10, -6}, {-4, -10, -6}, {-6, -6, -6}, glass));
-    //scene.push_back(new Triangle({2, -10, -6}, {6, -10, -6}, {4, -6, -6}, glass));
+    std::vector<Entity*> entities;
+    entities.push_back(new Sphere({-1, -8, -10}, 2, ivory));
+    entities.push_back(new Sphere({-7, -8, -20}, 2, glass));
+    entities.push_back(new Sphere({7, -8, -10}, 2, red_rubber));
+    entities.push_back(new Sphere({4, -8, -20}, 2, mirror));
+    entities.push_back(new Sphere({0, 10, -15}, 2, light));
+    entities.push_back(new Triangle({-8, -10, -6}, {-4, -10, -6}, {-6, -6, -6}, glass));
+    //entities.push_back(new Triangle({2, -10, -6}, {6, -10, -6}, {4, -6, -6}, glass));
+    //entities.push_back(generatePolyShphere(3, 64));
+
+    // Room, open towards the camera
+    Material back(glm::dvec3(.4, .4, .5), 1.0, glm::dvec4(1, 0, 0, 0), 0, MaterialType::Diffuse);
+    Material right(glm::dvec3(.1, .5, .1), 1.0, glm::dvec4(1, 0, 0, 0), 0, MaterialType::Diffuse);
+    Material left(glm::dvec3(.5, .1, .1), 1.0, glm::dvec4(1, 0, 0, 0), 0, MaterialType::Diffuse);
+    Material top(glm::dvec3(.2, .2, .5), 1.0, glm::dvec4(1, 0, 0, 0), 0, MaterialType::Diffuse);
+    Material bottom = Material::checkerboard(glm::dvec3(.3, .3, .3), glm::dvec3(.3, .2, .1), 2);
+    entities.push_back(new Quad({-10, -10, -30}, {20, 0, 0}, {0, 20, 0}, back));
+    entities.push_back(new Quad({-10, -10, 0}, {20, 0, 0}, {0, 0, -30}, bottom));
+    entities.push_back(new Quad({10, -10, 0}, {0, 20, 0}, {0, 0, -30}, right));
+    entities.push_back(new Quad({-10, -10, 0}, {0, 0, -30}, {0, 20, 0}, left));
+    entities.push_back(new Quad({-10, 10, 0}, {0, 0, -30}, {20, 0, 0}, top));
+
+    // Instances share one mesh and its BVH, and are spread over a grid on the floor.
+    int instances = parser.value(instancesOption).toInt();
+    if (instances > 0) {
+        TriangleMesh* mesh = generatePolyShphere(1, 32, threads);
+        int side = static_cast<int>(std::ceil(std::sqrt(instances)));
+        double cellX = 18.0 / side, cellZ = 26.0 / side;
+        double radius = 0.4 * std::min(cellX, cellZ);
+        for (int i = 0; i < instances; ++i) {
+            glm::dvec3 center(-9 + (i % side + 0.5) * cellX, -10 + 0.7 * radius,
+                              -28 + (i / side + 0.5) * cellZ);
+            glm::dmat4 transform = glm::translate(glm::dmat4(1), center);
+            transform = glm::rotate(transform, double(i), glm::dvec3(0, 1, 0));
+            transform = glm::scale(transform, glm::dvec3(radius, 0.7 * radius, radius));
+            entities.push_back(new Instance(mesh, transform, i % 2 ? red_rubber : back));
+        }
+    }
 
+    std::unique_ptr<Accelerator> scene;
+    if (parser.value(acceleratorOption) == "bvh") {
+        scene = std::make_unique<BVH>(entities, threads);
+    } else if (parser.value(acceleratorOption) == "qbvh") {
+        scene = std::make_unique<QBVH>(entities, threads);
+    } else {
+        BoundingBox bounds;
+        for (Entity* e : entities) bounds.grow(e->boundingBox());
+        auto octree = std::make_unique<Octree>(bounds.min, bounds.max);
+        for (Entity* e : entities) octree->push_back(e);
+        scene = std::move(octree);
+    }
 
-    raytracer.setScene(&scene);
+    raytracer.setScene(scene.get());
+    raytracer.setPacketSize(parser.value(packetOption).toInt());
+    raytracer.setThreads(threads);
+    if (parser.value(integratorOption) == "path") {
+        raytracer.setIntegrator(Integrator::PathTracing);
+    } else if (parser.value(integratorOption) == "bdpt") {
+        raytracer.setIntegrator(Integrator::Bidirectional);
+    } else if (parser.value(integratorOption) == "photon") {
+        raytracer.setIntegrator(Integrator::PhotonMapping);
+    } else if (parser.value(integratorOption) == "sppm") {
+        raytracer.setIntegrator(Integrator::ProgressivePhotonMapping);
+    } else {
+        raytracer.setIntegrator(Integrator::Whitted);
+    }
+    raytracer.setSamples(parser.value(samplesOption).toInt());
+    raytracer.setAdaptiveThreshold(parser.value(thresholdOption).toDouble());
+    raytracer.setSplitBounces(parser.value(splitOption).toInt());
+    raytracer.setPruneThreshold(parser.value(pruneOption).toDouble());
+    raytracer.setLightCut(parser.value(lightCutOption).toDouble());
+    raytracer.setPhotons(parser.value(photonsOption).toInt(),
+                         parser.value(causticPhotonsOption).toInt());
+    raytracer.setFinalGather(parser.value(gatherOption).toInt());
+    raytracer.setPassPhotons(parser.value(passPhotonsOption).toInt());
+    raytracer.setIrradianceCache(parser.value(irradianceCacheOption).toDouble(),
+                                 parser.value(irradianceRaysOption).toInt());
+    raytracer.setRadianceCache(parser.value(radianceCacheOption).toInt());
+    if (parser.value(misOption) == "none") {
+        raytracer.setMis(Mis::None);
+    } else if (parser.value(misOption) == "balance") {
+        raytracer.setMis(Mis::Balance);
+    } else {
+        raytracer.setMis(Mis::Power);
+    }
+    if (parser.value(samplerOption) == "independent") {
+        raytracer.setSampler(SamplerType::Independent);
+    } else if (parser.value(samplerOption) == "stratified") {
+        raytracer.setSampler(SamplerType::Stratified);
+    } else if (parser.value(samplerOption) == "bluenoise") {
+        raytracer.setSampler(SamplerType::BlueNoise);
+    } else {
+        raytracer.setSampler(SamplerType::Sobol);
+    }
 
     Gui window(500, 500, raytracer);
     window.show();